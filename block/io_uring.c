@@ -0,0 +1,566 @@
+/*
+ * Linux io_uring support.
+ *
+ * The submission and completion rings are shared with the kernel through
+ * mmap() and driven with the raw system calls, so there is no dependency on
+ * a user space library.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
+#include "block/raw-aio.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+
+/*
+ * Number of submission queue entries (per-device).  The kernel makes the
+ * completion queue twice as large; requests beyond what fits in the rings
+ * wait in submit_queue.
+ */
+#define LURING_QUEUE_DEPTH 128
+
+/* How often io_uring_enter() is retried when the kernel is short on memory */
+#define LURING_SUBMIT_RETRIES 3
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    struct LuringState *s;
+    struct io_uring_sqe sqeq;   /* copied into the ring on submission */
+    ssize_t ret;
+    int type;
+    QEMUIOVector *qiov;
+    off_t offset;
+    size_t nbytes;
+
+    /* Rest of a short read or write, resubmitted until it is complete */
+    size_t done;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringSQ {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *ring_mask;
+    unsigned *ring_entries;
+    unsigned *array;
+    struct io_uring_sqe *sqes;
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+} LuringSQ;
+
+typedef struct LuringCQ {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *ring_mask;
+    unsigned *ring_entries;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+} LuringCQ;
+
+typedef struct LuringState {
+    int fd;
+    LuringSQ sq;
+    LuringCQ cq;
+
+    /* Requests in the SQ ring or in the kernel; never more than fit the CQ */
+    unsigned int in_flight;
+
+    /* Requests waiting for room in the rings, submitted in batch */
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+    unsigned int queued;
+    int plugged;
+
+    /* Requests the kernel refused, completed from a BH */
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed_queue;
+    QEMUBH *failed_bh;
+
+    bool has_op[IORING_OP_LAST];
+} LuringState;
+
+static int luring_setup(unsigned entries, struct io_uring_params *p)
+{
+    int ret = syscall(__NR_io_uring_setup, entries, p);
+    return ret < 0 ? -errno : ret;
+}
+
+static int luring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                        unsigned flags)
+{
+    int ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+static int luring_register(int fd, unsigned opcode, void *arg,
+                           unsigned nr_args)
+{
+    int ret = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_complete(LuringAIOCB *acb)
+{
+    acb->common.cb(acb->common.opaque, acb->ret);
+
+    if (acb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&acb->resubmit_qiov);
+    }
+    qemu_aio_unref(acb);
+}
+
+/*
+ * Buffered reads and writes may transfer less than asked for, for example
+ * when the request crosses a page that had to be read in.  Queue the rest
+ * of the request again instead of failing it.
+ */
+static void luring_resubmit_rest(LuringAIOCB *acb, int nbytes)
+{
+    LuringState *s = acb->s;
+
+    acb->done += nbytes;
+    if (!acb->resubmit_qiov.iov) {
+        qemu_iovec_init(&acb->resubmit_qiov, acb->qiov->niov);
+    } else {
+        qemu_iovec_reset(&acb->resubmit_qiov);
+    }
+    qemu_iovec_concat(&acb->resubmit_qiov, acb->qiov, acb->done,
+                      acb->nbytes - acb->done);
+
+    acb->sqeq.addr = (uintptr_t)acb->resubmit_qiov.iov;
+    acb->sqeq.len = acb->resubmit_qiov.niov;
+    acb->sqeq.off = acb->offset + acb->done;
+
+    QSIMPLEQ_INSERT_TAIL(&s->submit_queue, acb, next);
+    s->queued++;
+}
+
+static void luring_process_result(LuringAIOCB *acb, int res)
+{
+    if (res < 0) {
+        acb->ret = res;
+    } else if (acb->type == QEMU_AIO_READ || acb->type == QEMU_AIO_WRITE) {
+        if (acb->done + res == acb->nbytes) {
+            acb->ret = 0;
+        } else if (res > 0) {
+            luring_resubmit_rest(acb, res);
+            return;
+        } else if (acb->type == QEMU_AIO_READ) {
+            /* EOF, pad with zeros */
+            qemu_iovec_memset(acb->qiov, acb->done, 0,
+                              acb->nbytes - acb->done);
+            acb->ret = 0;
+        } else {
+            acb->ret = -EIO;
+        }
+    } else {
+        acb->ret = res;
+    }
+
+    luring_complete(acb);
+}
+
+/* Moves waiting requests into the SQ ring as far as both rings have room */
+static void luring_fill_sq(LuringState *s)
+{
+    unsigned head = atomic_read(s->sq.head);
+    unsigned tail = *s->sq.tail;
+
+    while (!QSIMPLEQ_EMPTY(&s->submit_queue) &&
+           tail - head < *s->sq.ring_entries &&
+           s->in_flight < *s->cq.ring_entries) {
+        LuringAIOCB *acb = QSIMPLEQ_FIRST(&s->submit_queue);
+        unsigned idx = tail & *s->sq.ring_mask;
+
+        QSIMPLEQ_REMOVE_HEAD(&s->submit_queue, next);
+        s->queued--;
+        s->sq.sqes[idx] = acb->sqeq;
+        s->sq.array[idx] = idx;
+        tail++;
+        s->in_flight++;
+    }
+
+    /* The kernel must see the entries before it sees the new tail */
+    smp_wmb();
+    atomic_set(s->sq.tail, tail);
+}
+
+/*
+ * Takes the entries the kernel did not consume back out of the SQ ring and
+ * fails them with @ret.  The callbacks run from a BH, so that no request is
+ * completed before luring_submit() returned it.
+ */
+static void luring_fail_sq(LuringState *s, int ret)
+{
+    unsigned head = atomic_read(s->sq.head);
+    unsigned tail = *s->sq.tail;
+
+    for (; head != tail; head++) {
+        unsigned idx = s->sq.array[head & *s->sq.ring_mask];
+        LuringAIOCB *acb = (LuringAIOCB *)(uintptr_t)s->sq.sqes[idx].user_data;
+
+        acb->ret = ret;
+        QSIMPLEQ_INSERT_TAIL(&s->failed_queue, acb, next);
+        s->in_flight--;
+    }
+    atomic_set(s->sq.tail, atomic_read(s->sq.head));
+
+    qemu_bh_schedule(s->failed_bh);
+}
+
+static int luring_submit_queue(LuringState *s)
+{
+    unsigned to_submit;
+    int ret, retries = 0;
+
+    luring_fill_sq(s);
+    to_submit = *s->sq.tail - atomic_read(s->sq.head);
+
+    while (to_submit) {
+        ret = luring_enter(s->fd, to_submit, 0, 0);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == 0 || ret == -EAGAIN || ret == -EBUSY) {
+            if (retries++ < LURING_SUBMIT_RETRIES) {
+                continue;
+            }
+            if (ret == 0) {
+                ret = -EAGAIN;
+            }
+        }
+        if (ret < 0) {
+            luring_fail_sq(s, ret);
+            return ret;
+        }
+
+        /* Consumed entries leave room for more waiting requests */
+        luring_fill_sq(s);
+        to_submit = *s->sq.tail - atomic_read(s->sq.head);
+    }
+
+    return 0;
+}
+
+/*
+ * Fetches completed requests from the CQ ring and invokes their callbacks.
+ *
+ * Each entry is handed back to the kernel before its callback runs, so that
+ * a nested event loop started by the callback can reap the entries that
+ * follow it.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    unsigned head;
+
+    while ((head = *s->cq.head) != atomic_read(s->cq.tail)) {
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *acb;
+        int res;
+
+        /* Paired with the kernel's write barrier before it updates tail */
+        smp_rmb();
+        cqe = &s->cq.cqes[head & *s->cq.ring_mask];
+        acb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+
+        /* Finish reading the entry before the kernel may reuse it */
+        smp_mb();
+        atomic_set(s->cq.head, head + 1);
+        s->in_flight--;
+
+        luring_process_result(acb, res);
+    }
+
+    /* Resubmitted requests, or ones that were waiting for room */
+    if (!s->plugged && !QSIMPLEQ_EMPTY(&s->submit_queue)) {
+        luring_submit_queue(s);
+    }
+}
+
+static void luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions(s);
+}
+
+static void luring_failed_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    while (!QSIMPLEQ_EMPTY(&s->failed_queue)) {
+        LuringAIOCB *acb = QSIMPLEQ_FIRST(&s->failed_queue);
+
+        QSIMPLEQ_REMOVE_HEAD(&s->failed_queue, next);
+        luring_complete(acb);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static int luring_opcode(int type)
+{
+    switch (type) {
+    case QEMU_AIO_READ:
+        return IORING_OP_READV;
+    case QEMU_AIO_WRITE:
+        return IORING_OP_WRITEV;
+    case QEMU_AIO_FLUSH:
+        return IORING_OP_FSYNC;
+    case QEMU_AIO_DISCARD:
+        return IORING_OP_FALLOCATE;
+    default:
+        return -1;
+    }
+}
+
+/* Returns whether requests of @type can be submitted on this kernel */
+bool luring_supports(void *aio_ctx, int type)
+{
+    LuringState *s = aio_ctx;
+    int opcode = luring_opcode(type);
+
+    return opcode >= 0 && s->has_op[opcode];
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->plugged++;
+}
+
+int luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+    int ret = 0;
+
+    assert(s->plugged > 0 || !unplug);
+
+    if (unplug && --s->plugged > 0) {
+        return 0;
+    }
+
+    if (!QSIMPLEQ_EMPTY(&s->submit_queue)) {
+        ret = luring_submit_queue(s);
+    }
+
+    return ret;
+}
+
+/*
+ * Reads and writes go through @qiov.  QEMU_AIO_FLUSH is an fdatasync() and
+ * QEMU_AIO_DISCARD punches a hole with fallocate(); both ignore @qiov.  The
+ * caller checks luring_supports() first.
+ */
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+    struct io_uring_sqe *sqe;
+    off_t offset = sector_num * BDRV_SECTOR_SIZE;
+
+    assert(luring_supports(s, type));
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->ret = -EINPROGRESS;
+    acb->type = type;
+    acb->qiov = qiov;
+    acb->offset = offset;
+    acb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->done = 0;
+    memset(&acb->resubmit_qiov, 0, sizeof(acb->resubmit_qiov));
+
+    sqe = &acb->sqeq;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = luring_opcode(type);
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)acb;
+
+    switch (type) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = offset;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    case QEMU_AIO_DISCARD:
+        sqe->off = offset;
+        sqe->addr = acb->nbytes;
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        break;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->submit_queue, acb, next);
+    s->queued++;
+
+    /* While plugged, submit only once a full ring's worth is waiting */
+    if (!s->plugged || s->queued >= *s->sq.ring_entries) {
+        luring_submit_queue(s);
+    }
+    return &acb->common;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_fd_handler(old_context, s->fd, NULL, NULL, NULL);
+    qemu_bh_delete(s->failed_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->failed_bh = aio_bh_new(new_context, luring_failed_bh, s);
+    aio_set_fd_handler(new_context, s->fd, luring_completion_cb, NULL, s);
+}
+
+static void luring_probe(LuringState *s)
+{
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) +
+                 IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    int i;
+
+    probe = g_malloc0(len);
+    if (luring_register(s->fd, IORING_REGISTER_PROBE, probe,
+                        IORING_OP_LAST) < 0) {
+        /* Kernels before 5.6 cannot be asked, but have these since 5.1 */
+        s->has_op[IORING_OP_READV] = true;
+        s->has_op[IORING_OP_WRITEV] = true;
+        s->has_op[IORING_OP_FSYNC] = true;
+    } else {
+        for (i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++) {
+            s->has_op[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+        }
+    }
+    g_free(probe);
+}
+
+static void luring_unmap(LuringState *s)
+{
+    if (s->sq.sqes) {
+        munmap(s->sq.sqes, s->sq.sqes_size);
+    }
+    if (s->cq.ring_ptr && s->cq.ring_ptr != s->sq.ring_ptr) {
+        munmap(s->cq.ring_ptr, s->cq.ring_size);
+    }
+    if (s->sq.ring_ptr) {
+        munmap(s->sq.ring_ptr, s->sq.ring_size);
+    }
+}
+
+static void *luring_mmap(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/*
+ * Returns NULL if the kernel has no io_uring (before Linux 5.1) or does not
+ * let us use it, in which case the caller keeps using the thread pool.
+ */
+void *luring_init(void)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = luring_setup(LURING_QUEUE_DEPTH, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    s = g_new0(LuringState, 1);
+    s->fd = fd;
+    QSIMPLEQ_INIT(&s->submit_queue);
+    QSIMPLEQ_INIT(&s->failed_queue);
+
+    s->sq.ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    s->cq.ring_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        s->sq.ring_size = MAX(s->sq.ring_size, s->cq.ring_size);
+        s->cq.ring_size = s->sq.ring_size;
+    }
+
+    s->sq.ring_ptr = luring_mmap(fd, s->sq.ring_size, IORING_OFF_SQ_RING);
+    if (!s->sq.ring_ptr) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        s->cq.ring_ptr = s->sq.ring_ptr;
+    } else {
+        s->cq.ring_ptr = luring_mmap(fd, s->cq.ring_size, IORING_OFF_CQ_RING);
+        if (!s->cq.ring_ptr) {
+            goto fail;
+        }
+    }
+    s->sq.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    s->sq.sqes = luring_mmap(fd, s->sq.sqes_size, IORING_OFF_SQES);
+    if (!s->sq.sqes) {
+        goto fail;
+    }
+
+    s->sq.head = s->sq.ring_ptr + p.sq_off.head;
+    s->sq.tail = s->sq.ring_ptr + p.sq_off.tail;
+    s->sq.ring_mask = s->sq.ring_ptr + p.sq_off.ring_mask;
+    s->sq.ring_entries = s->sq.ring_ptr + p.sq_off.ring_entries;
+    s->sq.array = s->sq.ring_ptr + p.sq_off.array;
+
+    s->cq.head = s->cq.ring_ptr + p.cq_off.head;
+    s->cq.tail = s->cq.ring_ptr + p.cq_off.tail;
+    s->cq.ring_mask = s->cq.ring_ptr + p.cq_off.ring_mask;
+    s->cq.ring_entries = s->cq.ring_ptr + p.cq_off.ring_entries;
+    s->cq.cqes = s->cq.ring_ptr + p.cq_off.cqes;
+
+    luring_probe(s);
+    if (!s->has_op[IORING_OP_READV] || !s->has_op[IORING_OP_WRITEV]) {
+        goto fail;
+    }
+
+    return s;
+
+fail:
+    luring_unmap(s);
+    close(fd);
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    luring_unmap(s);
+    close(s->fd);
+    g_free(s);
+}
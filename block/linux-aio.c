@@ -12,20 +12,47 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h"
 
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Queue size (per-device), used unless the aio-queue-depth option says
+ * otherwise.
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
  *      than this we will get EAGAIN from io_submit which is communicated to
  *      the guest as an I/O error.
  */
-#define MAX_EVENTS 128
+#define LAIO_DEFAULT_QUEUE_DEPTH 128
 
-#define MAX_QUEUED_IO  128
+/* Smallest queue depth we retry io_setup() with when aio-max-nr is short */
+#define LAIO_MIN_QUEUE_DEPTH 16
+
+/* Adaptive polling: first window after a miss, and how it grows/shrinks */
+#define LAIO_POLL_START_NS 4000
+#define LAIO_POLL_GROW 2
+#define LAIO_POLL_SHRINK 2
+
+/*
+ * Layout of the completion ring that the kernel maps at the address returned
+ * by io_setup() (struct aio_ring in linux/fs/aio.c).  Completions can be
+ * reaped from here without entering the kernel.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
 
 struct qemu_laiocb {
     BlockAIOCB common;
@@ -39,7 +66,7 @@ struct qemu_laiocb {
 };
 
 typedef struct {
-    struct iocb *iocbs[MAX_QUEUED_IO];
+    struct iocb **iocbs;
     int plugged;
     unsigned int size;
     unsigned int idx;
@@ -54,9 +81,18 @@ struct qemu_laio_state {
 
     /* I/O completion processing */
     QEMUBH *completion_bh;
-    struct io_event events[MAX_EVENTS];
+    struct io_event *events;
     int event_idx;
     int event_max;
+
+    int max_events;     /* queue depth passed to io_setup() */
+    bool use_ring;      /* reap completions from the mapped ring */
+    int in_flight;      /* submitted requests without a completion */
+
+    /* Adaptive polling of the ring before going back to sleep */
+    int64_t poll_ns;        /* current polling window, 0 if not polling */
+    int64_t poll_max_ns;    /* upper limit, 0 disables polling */
+    int64_t poll_miss_ns;   /* when the last window expired, or 0 */
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -86,11 +122,108 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
             }
         }
     }
+    s->in_flight--;
     laiocb->common.cb(laiocb->common.opaque, ret);
 
     qemu_aio_unref(laiocb);
 }
 
+static bool qemu_laio_ring_empty(struct qemu_laio_state *s)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    return atomic_read(&ring->head) == atomic_read(&ring->tail);
+}
+
+/*
+ * Copies up to max_events completions from the ring to s->events and hands
+ * the slots back to the kernel.  This is what io_getevents() does with a zero
+ * timeout, minus the system call.
+ */
+static int qemu_laio_ring_fetch(struct qemu_laio_state *s)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+    unsigned int head = ring->head;
+    unsigned int tail = atomic_read(&ring->tail);
+    int n = 0;
+
+    /* Paired with smp_wmb() in the kernel's aio_complete() */
+    smp_rmb();
+
+    while (head != tail && n < s->max_events) {
+        s->events[n++] = ring->io_events[head];
+        head = (head + 1) % ring->nr;
+    }
+
+    /* Finish reading the events before the kernel may reuse the slots */
+    smp_mb();
+    atomic_set(&ring->head, head);
+    return n;
+}
+
+static int qemu_laio_fetch_events(struct qemu_laio_state *s)
+{
+    int ret;
+
+    if (s->use_ring) {
+        return qemu_laio_ring_fetch(s);
+    }
+
+    do {
+        struct timespec ts = { 0 };
+        ret = io_getevents(s->ctx, s->max_events, s->max_events,
+                           s->events, &ts);
+    } while (ret == -EINTR);
+
+    return ret;
+}
+
+/*
+ * Resizes the polling window after a completion arrived while we were
+ * sleeping: grow it if polling a bit longer would have caught the completion,
+ * shrink it if the device is too slow for polling to pay off.
+ */
+static void qemu_laio_poll_adjust(struct qemu_laio_state *s, int64_t block_ns)
+{
+    if (block_ns > s->poll_max_ns) {
+        s->poll_ns /= LAIO_POLL_SHRINK;
+    } else if (s->poll_ns < s->poll_max_ns) {
+        s->poll_ns = s->poll_ns ? s->poll_ns * LAIO_POLL_GROW
+                                : LAIO_POLL_START_NS;
+        s->poll_ns = MIN(s->poll_ns, s->poll_max_ns);
+    }
+}
+
+/*
+ * Busy-waits for a completion to show up in the ring while requests are in
+ * flight, for at most the current polling window.  Returns true if the ring
+ * is no longer empty.
+ */
+static bool qemu_laio_poll(struct qemu_laio_state *s)
+{
+    int64_t start, now;
+
+    if (!s->use_ring || !s->poll_max_ns || !s->in_flight) {
+        return false;
+    }
+
+    if (s->poll_ns) {
+        start = get_clock();
+        do {
+            if (!qemu_laio_ring_empty(s)) {
+                return true;
+            }
+            now = get_clock();
+        } while (now - start < s->poll_ns);
+    } else {
+        now = get_clock();
+    }
+
+    /* Fall back to the event notifier, and see how long it takes */
+    s->poll_miss_ns = now;
+    return false;
+}
+
 /* The completion BH fetches completed I/O requests and invokes their
  * callbacks.
  *
@@ -108,17 +241,21 @@ static void qemu_laio_completion_bh(void *opaque)
 
     /* Fetch more completion events when empty */
     if (s->event_idx == s->event_max) {
-        do {
-            struct timespec ts = { 0 };
-            s->event_max = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS,
-                                        s->events, &ts);
-        } while (s->event_max == -EINTR);
+        s->event_max = qemu_laio_fetch_events(s);
+        if (s->event_max <= 0 && qemu_laio_poll(s)) {
+            s->event_max = qemu_laio_fetch_events(s);
+        }
 
         s->event_idx = 0;
         if (s->event_max <= 0) {
             s->event_max = 0;
             return; /* no more events */
         }
+
+        if (s->poll_miss_ns) {
+            qemu_laio_poll_adjust(s, get_clock() - s->poll_miss_ns);
+            s->poll_miss_ns = 0;
+        }
     }
 
     /* Reschedule so nested event loops see currently pending completions */
@@ -162,6 +299,7 @@ static void laio_cancel(BlockAIOCB *blockacb)
         return;
     }
 
+    laiocb->ctx->in_flight--;
     laiocb->common.cb(laiocb->common.opaque, laiocb->ret);
 }
 
@@ -170,9 +308,10 @@ static const AIOCBInfo laio_aiocb_info = {
     .cancel_async       = laio_cancel,
 };
 
-static void ioq_init(LaioQueue *io_q)
+static void ioq_init(LaioQueue *io_q, unsigned int size)
 {
-    io_q->size = MAX_QUEUED_IO;
+    io_q->iocbs = g_new(struct iocb *, size);
+    io_q->size = size;
     io_q->idx = 0;
     io_q->plugged = 0;
 }
@@ -211,6 +350,7 @@ static void ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
 
     s->io_q.iocbs[idx++] = iocb;
     s->io_q.idx = idx;
+    s->in_flight++;
 
     /* submit immediately if queue is full */
     if (idx == s->io_q.size) {
@@ -280,6 +420,7 @@ BlockAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         if (io_submit(s->ctx, 1, &iocbs) < 0) {
             goto out_free_aiocb;
         }
+        s->in_flight++;
     } else {
         ioq_enqueue(s, iocbs);
     }
@@ -306,20 +447,47 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
 }
 
-void *laio_init(void)
+/*
+ * @queue_depth is the number of requests that can be in flight at a time, or
+ * 0 for the default.  If the system-wide aio-max-nr limit does not leave room
+ * for that many, a smaller queue is used.
+ *
+ * @poll_max_ns limits how long the completion BH may busy-wait for more
+ * completions while requests are in flight; 0 disables polling.
+ */
+void *laio_init(int queue_depth, int64_t poll_max_ns)
 {
     struct qemu_laio_state *s;
+    struct aio_ring *ring;
+    int ret;
+
+    if (queue_depth <= 0) {
+        queue_depth = LAIO_DEFAULT_QUEUE_DEPTH;
+    }
 
     s = g_malloc0(sizeof(*s));
     if (event_notifier_init(&s->e, false) < 0) {
         goto out_free_state;
     }
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0) {
+    while ((ret = io_setup(queue_depth, &s->ctx)) == -EAGAIN &&
+           queue_depth > LAIO_MIN_QUEUE_DEPTH) {
+        queue_depth = MAX(queue_depth / 2, LAIO_MIN_QUEUE_DEPTH);
+    }
+    if (ret != 0) {
         goto out_close_efd;
     }
 
-    ioq_init(&s->io_q);
+    s->max_events = queue_depth;
+    s->events = g_new(struct io_event, queue_depth);
+    ioq_init(&s->io_q, queue_depth);
+
+    /* Only look at the ring if it has the layout we know about */
+    ring = (struct aio_ring *)s->ctx;
+    s->use_ring = ring->magic == AIO_RING_MAGIC &&
+                  ring->incompat_features == 0 &&
+                  ring->header_length == sizeof(struct aio_ring);
+    s->poll_max_ns = poll_max_ns;
 
     return s;
 
@@ -340,5 +508,7 @@ void laio_cleanup(void *s_)
         fprintf(stderr, "%s: destroy AIO context %p failed\n",
                         __func__, &s->ctx);
     }
+    g_free(s->io_q.iocbs);
+    g_free(s->events);
     g_free(s);
 }
@@ -300,7 +300,7 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
+static BlockStats *bdrv_query_stats(BlockDriverState *bs)
 {
     BlockStats *s;
 
@@ -323,6 +323,9 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
@@ -344,7 +347,11 @@ BlockInfoList *qmp_query_block(Error **errp)
 
     for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
         BlockInfoList *info = g_malloc0(sizeof(*info));
+        AioContext *ctx = blk_get_aio_context(blk);
+
+        aio_context_acquire(ctx);
         bdrv_query_info(blk, &info->value, &local_err);
+        aio_context_release(ctx);
         if (local_err) {
             error_propagate(errp, local_err);
             goto err;
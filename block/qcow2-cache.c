@@ -28,11 +28,12 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;     /* used since the clock hand last passed */
+    uint64_t lru_counter;   /* value of the cache's lru_counter at last use */
     int     ref;
+    int     hash_next;      /* next entry in the same hash bucket, or -1 */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,39 +41,122 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+
+    /* All tables live in a single buffer, so a table pointer gives its index */
+    void*                   table_array;
+    int                     table_size;
+
+    /* Offset-keyed hash of the entries that hold a table (offset != 0) */
+    int*                    hash;
+    unsigned int            hash_mask;
+
+    /* CLOCK replacement: next entry considered for eviction */
+    int                     clock_hand;
+
+    /* Entries last used before cache_clean_lru_counter are idle */
+    uint64_t                lru_counter;
+    uint64_t                cache_clean_lru_counter;
+
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static unsigned int qcow2_cache_hash_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    /* Tables are cluster aligned; mix the cluster index (Fibonacci hashing) */
+    uint64_t h = (offset / c->table_size) * 0x9e3779b97f4a7c15ULL;
+
+    return (h >> 32) & c->hash_mask;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned int bucket = qcow2_cache_hash_bucket(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->hash[bucket];
+    c->hash[bucket] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->hash[qcow2_cache_hash_bucket(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_hash_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->hash[qcow2_cache_hash_bucket(c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_reset(Qcow2Cache *c)
+{
+    unsigned int b;
+    int i;
+
+    for (b = 0; b <= c->hash_mask; b++) {
+        c->hash[b] = -1;
+    }
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].hash_next = -1;
+    }
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
-    int i;
+    unsigned int hash_size;
+
+    /* At least twice as many buckets as entries keeps the chains short */
+    hash_size = 1;
+    while (hash_size < 2 * num_tables) {
+        hash_size <<= 1;
+    }
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = s->cluster_size;
+    c->hash_mask = hash_size - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
-    }
-
-    for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+    c->hash = g_try_new(int, hash_size);
+    c->table_array = qemu_try_blockalign(bs->file,
+                                         (size_t) num_tables * c->table_size);
+
+    if (!c->entries || !c->hash || !c->table_array) {
+        qemu_vfree(c->table_array);
+        g_free(c->hash);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
     }
 
+    qcow2_cache_hash_reset(c);
     return c;
-
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            qemu_vfree(c->entries[i].table);
-        }
-    }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -81,15 +165,59 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->hash);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+/*
+ * Drops clean, unused tables that have not been looked up since the previous
+ * call and gives their memory back to the host.
+ */
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
+{
+    uintptr_t page_size = getpagesize();
+    uintptr_t start, end;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (!t->offset || t->ref || t->dirty ||
+            t->lru_counter > c->cache_clean_lru_counter) {
+            continue;
+        }
+
+        qcow2_cache_hash_remove(c, i);
+        t->offset = 0;
+        t->referenced = false;
+
+        /* Only pages that belong to this table alone can be discarded */
+        start = ROUND_UP((uintptr_t) qcow2_cache_get_table_addr(c, i),
+                         page_size);
+        end = ((uintptr_t) qcow2_cache_get_table_addr(c, i) + c->table_size)
+              & ~(page_size - 1);
+        if (end > start) {
+            qemu_madvise((void *) start, end - start, QEMU_MADV_DONTNEED);
+        }
+    }
+
+    c->cache_clean_lru_counter = c->lru_counter;
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, int *size, uint64_t *hits,
+    uint64_t *misses)
+{
+    *size = c->size;
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -151,8 +279,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -188,6 +316,60 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
     return result;
 }
 
+typedef struct Qcow2DirtyTable {
+    int64_t offset;
+    int     index;
+} Qcow2DirtyTable;
+
+static int qcow2_dirty_table_cmp(const void *a, const void *b)
+{
+    const Qcow2DirtyTable *x = a, *y = b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Writes back up to max dirty tables in ascending offset order without
+ * evicting them. Stops early once requests to the image are in flight, so
+ * that only otherwise idle time is used. Unlike qcow2_cache_flush(), this
+ * does not flush the image file.
+ *
+ * Returns the number of tables written, or a negative errno value.
+ */
+int qcow2_cache_write_back(BlockDriverState *bs, Qcow2Cache *c, int max)
+{
+    Qcow2DirtyTable *dirty;
+    int nr_dirty = 0;
+    int i, ret = 0;
+
+    dirty = g_new(Qcow2DirtyTable, c->size);
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            dirty[nr_dirty].offset = c->entries[i].offset;
+            dirty[nr_dirty].index = i;
+            nr_dirty++;
+        }
+    }
+    qsort(dirty, nr_dirty, sizeof(dirty[0]), qcow2_dirty_table_cmp);
+
+    for (i = 0; i < MIN(nr_dirty, max); i++) {
+        if (!QLIST_EMPTY(&bs->tracked_requests)) {
+            break;
+        }
+        /* The table may have been replaced while we were waiting for I/O */
+        if (c->entries[dirty[i].index].offset != dirty[i].offset) {
+            continue;
+        }
+        ret = qcow2_cache_entry_flush(bs, c, dirty[i].index);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    g_free(dirty);
+    return ret < 0 ? ret : i;
+}
+
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
@@ -228,40 +410,40 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].referenced = false;
     }
+    qcow2_cache_hash_reset(c);
 
     return 0;
 }
 
+/*
+ * CLOCK replacement: the hand sweeps over the entries and evicts the first
+ * unused one that has not been looked up since the hand last passed it.
+ * Entries that have been are given another round.  Two full sweeps are
+ * always enough to find a victim unless every entry is in use.
+ */
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n, i;
 
+    for (n = 0; n < 2 * c->size; n++) {
+        i = c->clock_hand;
+        c->clock_hand = (i + 1) % c->size;
 
-    for (i = 0; i < c->size; i++) {
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced && c->entries[i].offset) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -275,11 +457,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_hash_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -296,28 +479,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
+    c->entries[i].lru_counter = ++c->lru_counter;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -339,16 +525,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -358,15 +536,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -1055,6 +1056,17 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    if (s->reservation_clusters) {
+        int64_t cluster_offset =
+            qcow2_alloc_reserved_clusters(bs, *host_offset, nb_clusters);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        } else if (cluster_offset > 0) {
+            *host_offset = cluster_offset;
+            return 0;
+        }
+    }
+
     if (*host_offset == 0) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -1383,29 +1395,137 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int qcow2_decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->out_buf, data->out_buf_size,
+                             data->buf, data->buf_size);
+}
+
+/*
+ * Drops all decompressed clusters. Must be called whenever compressed
+ * clusters may be freed or written, so that a later cluster at the same
+ * offset isn't served from the cache.
+ */
+void qcow2_decompress_cache_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        s->decompress_cache[i].offset = -1;
+    }
+    s->decompress_cache_gen++;
+}
+
+void qcow2_decompress_cache_free(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        g_free(s->decompress_cache[i].data);
+        s->decompress_cache[i].data = NULL;
+        s->decompress_cache[i].offset = -1;
+    }
+}
+
+/*
+ * Copies bytes at offset_in_cluster of the compressed cluster described by
+ * the L2 entry cluster_offset into qiov.
+ *
+ * Recently used clusters are kept decompressed. On a miss, s->lock is
+ * dropped while the compressed data is read and inflated in the thread
+ * pool, so that other requests can proceed in the meantime.
+ */
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset,
+                             QEMUIOVector *qiov, int offset_in_cluster,
+                             int bytes)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressedCluster *entry, *victim;
+    Qcow2DecompressData data;
+    ThreadPool *pool;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    uint64_t coffset, gen;
+    uint8_t *in_buf, *out_buf;
+    int i;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
+
+    victim = &s->decompress_cache[0];
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        entry = &s->decompress_cache[i];
+        if (entry->offset == coffset) {
+            entry->lru_counter = ++s->decompress_lru_counter;
+            qemu_iovec_from_buf(qiov, 0, entry->data + offset_in_cluster,
+                                bytes);
+            return 0;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+        if (entry->lru_counter < victim->lru_counter) {
+            victim = entry;
         }
-        s->cluster_cache_offset = coffset;
     }
-    return 0;
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    in_buf = qemu_try_blockalign(bs->file, nb_csectors * 512);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (in_buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    gen = s->decompress_cache_gen;
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, in_buf, nb_csectors);
+    if (ret >= 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = out_buf,
+            .out_buf_size   = s->cluster_size,
+            .buf            = in_buf + sector_offset,
+            .buf_size       = csize,
+        };
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, qcow2_decompress_worker, &data);
+        if (ret < 0) {
+            ret = -EIO;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+    /* Unless the cache was invalidated meanwhile, keep the cluster */
+    if (gen == s->decompress_cache_gen) {
+        g_free(victim->data);
+        victim->data = out_buf;
+        victim->offset = coffset;
+        victim->lru_counter = ++s->decompress_lru_counter;
+        out_buf = NULL;
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(in_buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
@@ -754,6 +754,67 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Data cluster reservation: with cluster-reservation-size set, allocating
+ * writes take their clusters from a contiguous extent whose refcounts were
+ * all set to 1 by a single update, instead of updating refcount blocks for
+ * every request. The extent is refilled when it runs out; clusters still in
+ * it are freed by qcow2_release_reserved_clusters().
+ *
+ * Returns the offset of the first of *nb_clusters clusters taken from the
+ * reservation (possibly fewer than requested), 0 if none could be taken
+ * because the reservation is disabled or doesn't start at offset (if
+ * non-zero), or -errno.
+ */
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+    unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t reserved_offset;
+    uint64_t n;
+
+    if (!s->reservation_clusters) {
+        return 0;
+    }
+
+    /* Only refill when the new extent is going to be used */
+    if (offset && (!s->reserved_clusters || offset != s->reserved_offset)) {
+        return 0;
+    }
+
+    if (!s->reserved_clusters) {
+        n = MAX(*nb_clusters, s->reservation_clusters);
+        reserved_offset = qcow2_alloc_clusters(bs, n << s->cluster_bits);
+        if (reserved_offset < 0) {
+            return reserved_offset;
+        }
+        s->reserved_offset = reserved_offset;
+        s->reserved_clusters = n;
+    }
+
+    n = MIN(*nb_clusters, s->reserved_clusters);
+    reserved_offset = s->reserved_offset;
+    s->reserved_offset += n << s->cluster_bits;
+    s->reserved_clusters -= n;
+
+    *nb_clusters = n;
+    return reserved_offset;
+}
+
+/* Returns the clusters that are still reserved to the free space */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->reserved_clusters) {
+        qcow2_free_clusters(bs, s->reserved_offset,
+                            s->reserved_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->reserved_offset = 0;
+        s->reserved_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -35,6 +35,7 @@
 #include "qapi-event.h"
 #include "trace.h"
 #include "qemu/option_int.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -333,7 +334,12 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Reserved clusters would be reported as leaked */
+    qcow2_release_reserved_clusters(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -467,6 +473,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Clean unused cache entries after this time (in seconds)",
+        },
+        {
+            .name = QCOW2_OPT_CLUSTER_RESERVATION_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the extents preallocated for data clusters",
+        },
         { /* end of list */ }
     },
 };
@@ -537,6 +553,87 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
     }
 }
 
+/* Maximum number of dirty tables per cache written back by one cleaner run */
+#define CACHE_CLEAN_WRITE_BACK_MAX 64
+
+/*
+ * Runs every cache_clean_interval seconds: writes back dirty tables while no
+ * guest requests are in flight, so that a later flush has less to do, and
+ * drops the tables that have not been used since the previous run.
+ */
+static void coroutine_fn qcow2_co_cache_clean(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (QLIST_EMPTY(&bs->tracked_requests)) {
+        /* Errors are reported by the next flush, the tables stay dirty */
+        qcow2_cache_write_back(bs, s->refcount_block_cache,
+                               CACHE_CLEAN_WRITE_BACK_MAX);
+        qcow2_cache_write_back(bs, s->l2_table_cache,
+                               CACHE_CLEAN_WRITE_BACK_MAX);
+    }
+    qcow2_cache_clean_unused(bs, s->l2_table_cache);
+    qcow2_cache_clean_unused(bs, s->refcount_block_cache);
+    qemu_co_mutex_unlock(&s->lock);
+
+    s->cache_clean_running = false;
+}
+
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    Coroutine *co;
+
+    if (!s->cache_clean_running) {
+        s->cache_clean_running = true;
+        co = qemu_coroutine_create(qcow2_co_cache_clean);
+        qemu_coroutine_enter(co, bs);
+    }
+    timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              (int64_t) s->cache_clean_interval * 1000);
+}
+
+static void cache_clean_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_interval > 0) {
+        s->cache_clean_timer = aio_timer_new(context, QEMU_CLOCK_VIRTUAL,
+                                             SCALE_MS, cache_clean_timer_cb,
+                                             bs);
+        timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->cache_clean_interval * 1000);
+    }
+}
+
+static void cache_clean_timer_del(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_timer) {
+        timer_del(s->cache_clean_timer);
+        timer_free(s->cache_clean_timer);
+        s->cache_clean_timer = NULL;
+    }
+    while (s->cache_clean_running) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
+static void qcow2_detach_aio_context(BlockDriverState *bs)
+{
+    cache_clean_timer_del(bs);
+}
+
+static void qcow2_attach_aio_context(BlockDriverState *bs,
+                                     AioContext *new_context)
+{
+    cache_clean_timer_init(bs, new_context);
+}
+
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
@@ -551,6 +648,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t cache_clean_interval;
+    uint64_t reservation_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -816,6 +915,25 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    cache_clean_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL, 0);
+    if (cache_clean_interval > UINT_MAX / 1000) {
+        error_setg(errp, "Cache clean interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->cache_clean_interval = cache_clean_interval;
+
+    reservation_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_RESERVATION_SIZE, 0);
+    if (reservation_size && reservation_size < s->cluster_size) {
+        error_setg(errp, "cluster-reservation-size may not be less than the "
+                   "cluster size (%d)", s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->reservation_clusters = reservation_size >> s->cluster_bits;
+
     refcount_cache_size /= s->cluster_size;
     if (refcount_cache_size < MIN_REFCOUNT_CACHE_SIZE) {
         refcount_cache_size = MIN_REFCOUNT_CACHE_SIZE;
@@ -835,17 +953,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->cluster_cache_offset = -1;
+    qcow2_decompress_cache_invalidate(bs);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -904,6 +1012,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
@@ -981,6 +1090,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1004,8 +1115,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_decompress_cache_free(bs);
     return ret;
 }
 
@@ -1066,6 +1176,7 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     int ret;
 
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_reserved_clusters(state->bs);
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             return ret;
@@ -1201,15 +1312,12 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_decompress_cluster(bs, cluster_offset, &hd_qiov,
+                                           index_in_cluster * 512,
+                                           512 * cur_nr_sectors);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1298,10 +1406,11 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
+    /* Compressed clusters may be freed and their space reused */
+    qcow2_decompress_cache_invalidate(bs);
+
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -1423,11 +1532,15 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    cache_clean_timer_del(bs);
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
 
     if (!(bs->open_flags & BDRV_O_INCOMING)) {
+        qcow2_release_reserved_clusters(bs);
         qcow2_cache_flush(bs, s->l2_table_cache);
         qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -1440,8 +1553,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_decompress_cache_free(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2137,11 +2249,65 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    int dest_size;
+    const uint8_t *src;
+    int src_size;
+    int ret;
+} Qcow2CompressData;
+
+/*
+ * Deflates src into dest. data->ret is set to the compressed size, to
+ * -ENOSPC if the data does not fit into dest, or to -EINVAL on errors.
+ */
+static int qcow2_compress_worker(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        data->ret = -EINVAL;
+        return 0;
+    }
+
+    strm.avail_in = data->src_size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->dest_size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        data->ret = strm.next_out - data->dest;
+    } else if (ret == Z_OK) {
+        data->ret = -ENOSPC;
+    } else {
+        data->ret = -EINVAL;
+    }
+
+    deflateEnd(&strm);
+    return 0;
+}
+
+/*
+ * When called in coroutine context, the cluster is deflated in the thread
+ * pool so that several callers can compress in parallel. Their clusters are
+ * still allocated at the end of the image in the order of the calls: each
+ * call draws a ticket on entry and waits for its turn before allocating.
+ */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    Qcow2CompressData data;
+    bool in_co = qemu_in_coroutine();
+    uint64_t ticket = 0;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -2172,46 +2338,59 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    data = (Qcow2CompressData) {
+        .dest       = out_buf,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = s->cluster_size,
+    };
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    if (in_co) {
+        ticket = s->compress_ticket_next++;
+        thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                              qcow2_compress_worker, &data);
+        while (ticket != s->compress_ticket_done) {
+            qemu_co_queue_wait(&s->compress_queue);
+        }
+    } else {
+        qcow2_compress_worker(&data);
+    }
+    out_len = data.ret;
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
+    if (out_len == -EINVAL) {
         ret = -EINVAL;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len < 0 || out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        if (in_co) {
+            qemu_co_mutex_lock(&s->lock);
+        }
+        qcow2_decompress_cache_invalidate(bs);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
+        if (in_co) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (!cluster_offset) {
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
 
+        /* The space is allocated, the next caller may go ahead */
+        if (in_co) {
+            s->compress_ticket_done++;
+            qemu_co_queue_restart_all(&s->compress_queue);
+            in_co = false;
+        }
+
         ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
         if (ret < 0) {
             goto fail;
@@ -2226,6 +2405,10 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = 0;
 fail:
+    if (in_co) {
+        s->compress_ticket_done++;
+        qemu_co_queue_restart_all(&s->compress_queue);
+    }
     g_free(out_buf);
     return ret;
 }
@@ -2453,6 +2636,26 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static Qcow2CacheStats *qcow2_get_cache_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats;
+    uint64_t hits, misses;
+    int size;
+
+    qcow2_cache_get_stats(c, &size, &hits, &misses);
+    if (!hits && !misses) {
+        return NULL;
+    }
+
+    stats = g_new(Qcow2CacheStats, 1);
+    *stats = (Qcow2CacheStats){
+        .entries    = size,
+        .hits       = hits,
+        .misses     = misses,
+    };
+    return stats;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -2480,6 +2683,13 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
         };
     }
 
+    spec_info->qcow2->l2_cache = qcow2_get_cache_stats(s->l2_table_cache);
+    spec_info->qcow2->has_l2_cache = spec_info->qcow2->l2_cache != NULL;
+    spec_info->qcow2->refcount_cache =
+        qcow2_get_cache_stats(s->refcount_block_cache);
+    spec_info->qcow2->has_refcount_cache =
+        spec_info->qcow2->refcount_cache != NULL;
+
     return spec_info;
 }
 
@@ -2854,6 +3064,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
+    .bdrv_detach_aio_context  = qcow2_detach_aio_context,
+    .bdrv_attach_aio_context  = qcow2_attach_aio_context,
     .bdrv_create        = qcow2_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = qcow2_co_get_block_status,
@@ -2867,6 +3079,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .supports_concurrent_compressed_writes = true,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -93,6 +93,8 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CLUSTER_RESERVATION_SIZE "cluster-reservation-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -213,6 +215,15 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/* Number of decompressed clusters kept for reads of compressed clusters */
+#define QCOW2_DECOMPRESS_CACHE_SIZE 8
+
+typedef struct Qcow2DecompressedCluster {
+    uint64_t offset;        /* of the compressed data, -1 if unused */
+    uint8_t *data;
+    uint64_t lru_counter;
+} Qcow2DecompressedCluster;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
@@ -231,10 +242,13 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    QEMUTimer *cache_clean_timer;
+    unsigned cache_clean_interval;  /* seconds, 0 if disabled */
+    bool cache_clean_running;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2DecompressedCluster decompress_cache[QCOW2_DECOMPRESS_CACHE_SIZE];
+    uint64_t decompress_lru_counter;
+    uint64_t decompress_cache_gen;  /* incremented on each invalidation */
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -243,8 +257,18 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Preallocated extent for data clusters, see qcow2_alloc_reserved_clusters */
+    uint64_t reservation_clusters;  /* size of a new extent, 0 if disabled */
+    uint64_t reserved_offset;
+    uint64_t reserved_clusters;
+
     CoMutex lock;
 
+    /* Orders compressed cluster allocations, see qcow2_write_compressed */
+    uint64_t compress_ticket_next;
+    uint64_t compress_ticket_done;
+    CoQueue compress_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -496,6 +520,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+    unsigned int *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -520,7 +547,11 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset,
+                             QEMUIOVector *qiov, int offset_in_cluster,
+                             int bytes);
+void qcow2_decompress_cache_invalidate(BlockDriverState *bs);
+void qcow2_decompress_cache_free(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -575,5 +606,9 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, int *size, uint64_t *hits,
+    uint64_t *misses);
+int qcow2_cache_write_back(BlockDriverState *bs, Qcow2Cache *c, int max);
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c);
 
 #endif
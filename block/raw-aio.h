@@ -33,7 +33,7 @@
 
 /* linux-aio.c - Linux native implementation */
 #ifdef CONFIG_LINUX_AIO
-void *laio_init(void);
+void *laio_init(int queue_depth, int64_t poll_max_ns);
 void laio_cleanup(void *s);
 BlockAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
@@ -44,6 +44,20 @@ void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
 int laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug);
 #endif
 
+/* io_uring.c - Linux io_uring implementation */
+#ifdef CONFIG_LINUX_IO_URING
+void *luring_init(void);
+void luring_cleanup(void *s);
+bool luring_supports(void *s, int type);
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type);
+void luring_detach_aio_context(void *s, AioContext *old_context);
+void luring_attach_aio_context(void *s, AioContext *new_context);
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx);
+int luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug);
+#endif
+
 #ifdef _WIN32
 typedef struct QEMUWin32AIOState QEMUWin32AIOState;
 QEMUWin32AIOState *win32_aio_init(void);
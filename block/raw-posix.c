@@ -124,6 +124,10 @@
 
 #define MAX_BLOCKSIZE	4096
 
+/* Upper limit for the aio-queue-depth option (the kernel's default aio-max-nr
+ * is 65536 for the whole system) */
+#define RAW_AIO_MAX_QUEUE_DEPTH 65536
+
 typedef struct BDRVRawState {
     int fd;
     int type;
@@ -140,6 +144,12 @@ typedef struct BDRVRawState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
     void *aio_ctx;
+    int aio_queue_depth;
+    int64_t aio_poll_max_ns;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_luring;
+    void *luring_ctx;
 #endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
@@ -313,29 +323,44 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring) {
+        luring_detach_aio_context(s->luring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring) {
+        luring_attach_aio_context(s->luring_ctx, new_context);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags,
+                       int queue_depth, int64_t poll_max_ns)
 {
     int ret = -1;
     assert(aio_ctx != NULL);
@@ -349,7 +374,7 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
 
         /* if non-NULL, laio_init() has already been run */
         if (*aio_ctx == NULL) {
-            *aio_ctx = laio_init();
+            *aio_ctx = laio_init(queue_depth, poll_max_ns);
             if (!*aio_ctx) {
                 goto error;
             }
@@ -386,6 +411,17 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "aio-queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of in-flight requests with aio=native",
+        },
+        {
+            .name = "aio-poll-max-ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum time to poll for completions with aio=native "
+                    "(0 disables polling)",
+        },
         { /* end of list */ }
     },
 };
@@ -399,6 +435,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     const char *filename = NULL;
     int fd, ret;
     struct stat st;
+#ifdef CONFIG_LINUX_AIO
+    uint64_t aio_queue_depth, aio_poll_max_ns;
+#endif
 
     opts = qemu_opts_create(&raw_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -431,7 +470,26 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    aio_queue_depth = qemu_opt_get_number(opts, "aio-queue-depth", 0);
+    aio_poll_max_ns = qemu_opt_get_number(opts, "aio-poll-max-ns", 0);
+    if (aio_queue_depth > RAW_AIO_MAX_QUEUE_DEPTH) {
+        qemu_close(fd);
+        error_setg(errp, "aio-queue-depth must not exceed %d",
+                   RAW_AIO_MAX_QUEUE_DEPTH);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (aio_poll_max_ns > INT64_MAX) {
+        qemu_close(fd);
+        error_setg(errp, "aio-poll-max-ns is too large");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->aio_queue_depth = aio_queue_depth;
+    s->aio_poll_max_ns = aio_poll_max_ns;
+
+    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags,
+                    s->aio_queue_depth, s->aio_poll_max_ns)) {
         qemu_close(fd);
         ret = -errno;
         error_setg_errno(errp, -ret, "Could not set AIO state");
@@ -488,6 +546,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Set up last, nothing below can fail and leak the ring.  Without
+     * io_uring in the kernel, stay with the thread pool */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        s->luring_ctx = luring_init();
+        s->use_luring = s->luring_ctx != NULL;
+    }
+#endif
+
     raw_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     ret = 0;
@@ -536,7 +603,8 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
      * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
      * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags,
+                    s->aio_queue_depth, s->aio_poll_max_ns)) {
         error_setg(errp, "Could not set AIO state");
         return -1;
     }
@@ -1101,38 +1169,66 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->luring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring) {
+        luring_io_plug(bs, s->luring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring) {
+        luring_io_unplug(bs, s->luring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring) {
+        luring_io_unplug(bs, s->luring_ctx, false);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1159,6 +1255,13 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring && luring_supports(s->luring_ctx, QEMU_AIO_FLUSH)) {
+        return luring_submit(bs, s->luring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1172,6 +1275,11 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_luring) {
+        luring_cleanup(s->luring_ctx);
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -1626,12 +1734,52 @@ static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
     return ret | BDRV_BLOCK_OFFSET_VALID | start;
 }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+typedef struct RawLuringDiscard {
+    BDRVRawState *s;
+    BlockCompletionFunc *cb;
+    void *opaque;
+} RawLuringDiscard;
+
+/* Same error handling as handle_aiocb_discard() */
+static void raw_luring_discard_cb(void *opaque, int ret)
+{
+    RawLuringDiscard *d = opaque;
+
+    if (ret == -ENODEV || ret == -ENOSYS || ret == -EOPNOTSUPP ||
+        ret == -ENOTTY) {
+        d->s->has_discard = false;
+        ret = -ENOTSUP;
+    }
+    d->cb(d->opaque, ret);
+    g_free(d);
+}
+#endif
+
 static coroutine_fn BlockAIOCB *raw_aio_discard(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors,
     BlockCompletionFunc *cb, void *opaque)
 {
     BDRVRawState *s = bs->opaque;
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    /* The ring punches holes with fallocate(); XFS wants its own ioctl */
+    if (s->use_luring && s->has_discard &&
+#ifdef CONFIG_XFS
+        !s->is_xfs &&
+#endif
+        luring_supports(s->luring_ctx, QEMU_AIO_DISCARD)) {
+        RawLuringDiscard *d = g_new(RawLuringDiscard, 1);
+
+        d->s = s;
+        d->cb = cb;
+        d->opaque = opaque;
+        return luring_submit(bs, s->luring_ctx, s->fd, sector_num, NULL,
+                             nb_sectors, raw_luring_discard_cb, d,
+                             QEMU_AIO_DISCARD);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
@@ -6,11 +6,20 @@
  */
 // {{{ #include
 #include <lz4.h>
+#include <sys/mman.h>
 
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+#include "block/blockjob.h"
+#include "qemu/ratelimit.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi/qmp/qdict.h"
+#include "block/thread-pool.h"
+#include "qemu/crc32c.h"
 // }}}
 // {{{ Macros
 // unused/z/n/l2
@@ -25,12 +34,57 @@
 
 // only used for l1/l2
 #define SELFIE_PAGE_SIZE ((UINT64_C(4096)))
+
+// l1 entry flag: the 512 clusters of this l2 are one extent of contiguous
+// n-units starting at (entry & ~L1_EXTENT); no l2 page exists on disk or in memory
+#define L1_EXTENT ((UINT64_C(1)))
+
+// l2 entry of a cluster that reads as zeroes and has no data unit
+// page 1 holds zone info (or nothing, with a metadata file): never a data unit
+#define SELFIE_PA_ZERO ((UINT64_C(4096)))
+
+// header flags
+#define SELFIE_F_META_FILE ((UINT64_C(1) << 0)) // zone info, l1 and l-zones in meta_file
+#define SELFIE_F_CHECKSUM  ((UINT64_C(1) << 1)) // crc32c of every data unit
+#define SELFIE_F_DIRTY     ((UINT64_C(1) << 2)) // open for writing, checksums may lag their data
+
+#define SELFIE_META_PATH_SIZE ((1024))
+
+// readahead window, in clusters (min) and bytes (default max)
+#define RA_MIN_WINDOW ((4))
+#define RA_DEFAULT_SIZE ((UINT64_C(256) * 1024))
+
+// open zones per data type (z/n); l2 pages always use one stream
+#define SELFIE_MAX_STREAMS ((16))
+#define SELFIE_DEFAULT_STREAMS ((4))
+#define SELFIE_NO_ZONE ((UINT64_MAX))
+// unused zones that data allocation leaves to l2 pages
+#define SELFIE_ZONE_RESERVE ((1))
+
+// stream classes: data of similar lifetime shares zones
+#define STREAM_COLD  ((0)) // first writes and rarely rewritten clusters
+#define STREAM_HOT   ((1)) // clusters rewritten often in recent epochs
+#define STREAM_RELOC ((2)) // cold clusters moved by defrag, one stream
+#define SELFIE_NR_CLASSES ((3))
+
+// per-cluster write temperature: 2-bit saturating counters, halved every epoch
+#define HEAT_MAX ((3))
+#define HEAT_HOT ((2)) // the write that brings a cluster here makes it hot
+#define HEAT_EPOCH_WRITES ((UINT64_C(1) << 16)) // cluster writes per epoch
+
+// compressed writes (qemu-img convert -c) are buffered and encoded in batches
+#define CBATCH_SIZE ((UINT64_C(4) << 20)) // bytes of clusters per batch
+#define CBATCH_WORKERS ((8)) // encoding jobs per batch
 // }}}
 // {{{ structs
 static const uint8_t SELFIE_MAGIC[8] = {'Z','B','D','M','A','G','I','C'};
 
 // header (1) | zone_info (?) | l1_pages (nr_l1) | zones (data/l2)...
-// selfie metafile header (Immutable)
+// After growing, zone_info and l1_pages are relocated right after the last zone:
+// header (1) | (dead) | zones (nr_zones) | zone_info | l1_pages
+// With SELFIE_F_META_FILE, zone_info, l1_pages and l-zones are stored at the same
+// offsets in a separate metadata file; the main file only holds the header and data zones.
+// selfie metafile header (only rewritten by resize/amend)
 struct __attribute__((packed)) SelfieHeader {
   uint8_t  magic[8];
   uint64_t capacity;
@@ -43,50 +97,139 @@ struct __attribute__((packed)) SelfieHeader {
   uint64_t pa_zones; // start of data/l2 zones
   uint64_t init_type; // none/trim/zero
   //struct   timespec ts;
+  uint64_t flags; // SELFIE_F_*
+  char     meta_file[SELFIE_META_PATH_SIZE]; // relative to the image if not absolute
 };
 
 // buffered if allocated from z-zone
 // write immediately if allocated from n-zone
+// a fully contiguous n-zone l2 is stored as an extent in l1 (L1_EXTENT)
+// with mmap-index, pages point into the read-only mapping until first changed
 struct SelfieIndexL1 {
   CoMutex write_lock;
   bool   dirty1;      // l1 is dirty;
+  bool   mapped1;     // l1_page is in the mapping
   uint64_t * l1_page; // *512
   bool   dirty2[512]; // each l2 in l1 is dirty?
+  bool   mapped2[512]; // l2_pages[] is in the mapping
+  bool   checked[512]; // l1 entry has been validated (and its l2 mapped in)
   uint64_t * l2_pages[512];
+  struct SelfieHeat * heat[512]; // allocated on first write under the l2
+};
+
+// write temperature of the clusters under one l2 page, in memory only
+struct SelfieHeat {
+  uint64_t epoch;   // counters are decayed up to this epoch
+  uint8_t c[512];   // 0..HEAT_MAX
 };
 
 //// Zone
 // No update on allocation for z-zone.
 // sync-write on allocation for n-zone.
+// c was the top of n in older images, where n never reached 2^28: they read as cold
 struct SelfieZoneInfo {
-  uint32_t n:30; // next_id;
+  uint32_t n:28; // next_id;
+  uint32_t c:2;  // STREAM_* of the stream that opened the zone
   uint32_t t:2;  // 0: unused, 1: z-zone, 2: n-zone
 };
 
+// sequential read detection and cluster readahead
+// holds raw image content (z-pages are still encoded)
+struct SelfieReadahead {
+  CoMutex lock;        // protects the fields below, never held across i/o
+  uint64_t pa;         // buffered range [pa, pa + len)
+  uint64_t len;
+  bool valid;          // cleared by overlapping writes
+  uint64_t last_pa;    // pa of the last cluster read
+  uint64_t window;     // clusters to fetch on the next sequential miss
+  uint64_t max_window; // 0: disabled
+  uint8_t * buf;       // [max_window * block_size]
+  bool filling;        // stage is being read, one refill at a time
+  uint64_t fill_pa;    // range being read into stage
+  uint64_t fill_len;
+  bool fill_valid;     // cleared by writes overlapping the refill
+  uint8_t * stage;     // [max_window * block_size], swapped with buf once read
+};
+
+// an open zone that allocations of one type are appended to
+struct SelfieStream {
+  CoMutex lock;     // serializes allocations from this stream
+  uint64_t id_zone; // current zone, SELFIE_NO_ZONE before the first allocation
+  uint8_t cls;      // STREAM_*, recorded in the zone info of the zones it opens
+};
+
+// clusters buffered by bdrv_write_compressed, in ascending va order
+struct SelfieCBatch {
+  uint64_t cap;      // clusters per batch, 0 before the first compressed write
+  uint64_t nr;       // buffered clusters
+  uint64_t * va;     // [cap]
+  bool * z;          // [cap] encoded as a z-unit
+  uint8_t * raw;     // [cap * block_size]
+  uint8_t * enc;     // [cap * block_size] z-units
+  uint8_t * run;     // [cap * block_size] gathers a run of units for one write
+  uint64_t pending;  // encoding jobs in flight
+  Coroutine * waiter; // waits for pending to drop to 0
+  CoMutex lock;      // one flush at a time
+  bool unsynced;     // in-memory mappings not written to the index yet
+};
+
 #define I_LOCK_SCALE ((64))
 struct SelfieState {
   struct SelfieHeader header; // read from image on open, never rewrite
   BlockDriverState * main; // the file
+  BlockDriverState * meta; // metadata file, NULL if metadata lives in main
   struct SelfieIndexL1 * nodes; // [header.nr_l1]
   struct SelfieZoneInfo * zones; // [header.nr_zones]
-  uint64_t id_zzone; // current z-zone
-  uint64_t id_nzone; // current n-zone
-  uint64_t id_lzone; // current l-zone
+  uint32_t * zone_live; // [header.nr_zones] units of data zones still mapped, NULL with mmap-index
+  struct SelfieStream zstreams[SELFIE_NR_CLASSES][SELFIE_MAX_STREAMS]; // [class][nr_streams]
+  struct SelfieStream nstreams[SELFIE_NR_CLASSES][SELFIE_MAX_STREAMS]; // [class][nr_streams]
+  struct SelfieStream lstream;
+  uint64_t nr_streams;
+  uint64_t id_free; // no unused zone below id_free
+  uint64_t nr_zones_free; // unused zones
+  uint64_t * orphans; // [nr_orphans] partially used zones that no stream took on open
+  uint64_t nr_orphans;
+  // read-only mapping of the file holding l1 and l-zones, NULL without mmap-index
+  uint8_t * imap;
+  uint64_t imap_size;
+  struct SelfieZoneInfo * zones_open; // zone info at open, validates mapped pages
   uint64_t block_size; // 1<<block_shift (aligned to 4KB)
   uint64_t zdata_size; // maximum data size after compression
   uint64_t zbuffer_size; // block_size + max_compression_size (+aligned to 4KB)
   uint64_t nr_zone_unit; // for alloc data
+  uint64_t nr_zone_unit_n; // data units of a n-zone, the rest holds checksums
+  uint32_t ** ncsum; // [nr_zones] n-zone checksum tables, read on first use
   uint64_t nr_zone_page; // for alloc l2
   // locks
   CoMutex index_lock[I_LOCK_SCALE];
-  CoMutex zone_lock;
-  // below is for debug
-  int fd_log;
+  CoMutex zone_lock; // claiming unused zones
+  CoRwlock reloc_lock; // guest writes: read, relocation (defrag): write
+  CoMutex csum_lock; // n-zone checksum table updates
+  struct SelfieReadahead ra;
+  struct SelfieCBatch cbatch;
+  // statistics
   uint64_t nr_write_data_z;
   uint64_t nr_write_data_n;
   uint64_t nr_write_zone;
   uint64_t nr_write_l1;
   uint64_t nr_write_l2;
+  uint64_t nr_compress;     // clusters passed to lz4
+  uint64_t nr_compress_hit; // clusters fit in a z-unit
+  uint64_t nr_z_to_n;       // clusters moved from z-zone to n-zone
+  uint64_t nr_leaked;       // data units replaced since open
+  uint64_t nr_leaked_scan;  // replaced z-units found by the open-time scan
+  uint64_t nr_reclaimed;    // zones freed once all their units lost their data
+  bool reclaim_pending;     // a zone may have lost all its units, see zone_reclaim_sync()
+  uint64_t nr_alloc_hot;    // data units allocated from hot streams
+  uint64_t nr_csum_errors;  // data units failing checksum verification
+  uint64_t nr_csum_repairs; // checksums rebuilt after an unclean shutdown
+  bool csum_repair;         // opened with SELFIE_F_DIRTY set, see data_read_recheck()
+  uint64_t nr_write_zero;   // cluster writes of zeroes, mapped without data
+  uint64_t nr_index_pages;  // l1/l2 pages allocated in memory (not in the mapping)
+  uint64_t nr_index_heat;   // heat records allocated
+  uint64_t nr_zones_of[4];  // zones per ZONE_TYPE_*, unused ones are nr_zones_free
+  uint64_t nr_units_of[4];  // units (pages for l-zones) handed out per ZONE_TYPE_*
+  uint64_t nr_heat_writes;  // cluster writes, drives the heat epoch
 };
 
 struct __attribute__((packed)) SelfiePageHead {
@@ -102,78 +245,148 @@ struct SelfieZPage {
   };
 };
 // }}}
-// {{{ lock/unlock, logging
+// {{{ lock/unlock
+// all metadata work runs in coroutines, see selfie_co_call()
   static inline void
 __lock(CoMutex * const lock)
 {
-  if (qemu_in_coroutine()) qemu_co_mutex_lock(lock);
+  assert(qemu_in_coroutine());
+  qemu_co_mutex_lock(lock);
 }
 
   static inline void
 __unlock(CoMutex * const lock)
 {
-  if (qemu_in_coroutine()) qemu_co_mutex_unlock(lock);
+  assert(qemu_in_coroutine());
+  qemu_co_mutex_unlock(lock);
 }
 
-  static void
-selfie_log(struct SelfieState * const s, const char * const msg, ...)
+struct SelfieCoCall {
+  struct SelfieState * s;
+  void (*fn)(struct SelfieState * const, void * const);
+  void * opaque;
+  bool done;
+};
+
+  static void coroutine_fn
+selfie_co_call_entry(void * const opaque)
 {
-  if (s->fd_log < 0) return;
+  struct SelfieCoCall * const call = opaque;
+  call->fn(call->s, call->opaque);
+  call->done = true;
+}
 
-  char head[1024];
-  char tail[1024];
-  sprintf(head, "[]");
+// run fn in a coroutine and wait for it in the image's AioContext
+// for the entry points the block layer calls outside of a coroutine (open, close, ...)
+  static void
+selfie_co_call(struct SelfieState * const s, BlockDriverState * const bs,
+    void (*fn)(struct SelfieState * const, void * const), void * const opaque)
+{
+  struct SelfieCoCall call = {.s = s, .fn = fn, .opaque = opaque, .done = false};
+  if (qemu_in_coroutine()) {
+    selfie_co_call_entry(&call);
+    return;
+  }
+  Coroutine * const co = qemu_coroutine_create(selfie_co_call_entry);
+  qemu_coroutine_enter(co, &call);
+  AioContext * const ctx = bdrv_get_aio_context(bs);
+  while (!call.done) {
+    aio_poll(ctx, true);
+  }
+}
+// }}}
+// {{{ layout
+// number of l1 pages covering the given capacity
+  static inline uint64_t
+layout_nr_l1(const uint64_t block_size, const uint64_t capacity)
+{
+  const uint64_t size_l1 = block_size * 512 * 512;
+  return (capacity + size_l1 - 1) / size_l1;
+}
 
-  va_list varg;
-  va_start(varg, msg);
-  vsnprintf(tail, sizeof(tail), msg, varg);
-  va_end(varg);
-  dprintf(s->fd_log, "%s%s\n", head, tail);
+// each cluster may live in a z-zone and later in a n-zone
+  static inline uint64_t
+layout_nr_zones(const uint64_t zone_size, const uint64_t capacity)
+{
+  return (capacity / zone_size) * 2 + 1;
 }
 
-  static inline void
-selfie_log_addr(struct SelfieState * const s, const char * const tag, const uint64_t start, const uint64_t size)
+// number of pages holding the zone info
+  static inline uint64_t
+layout_zone_pages(const uint64_t nr_zones)
 {
-#if 0
-  const uint64_t gb = size >> 30;
-  const uint64_t mb = (size >> 20) & 0x3ff;
-  const uint64_t kb = (size >> 10) & 0x3ff;
-  const uint64_t b = size & 0x3ff;
-  char buf[4][16];
-  sprintf(buf[0], "%"PRIu64"GB+", gb);
-  sprintf(buf[1], "%"PRIu64"MB+", mb);
-  sprintf(buf[2], "%"PRIu64"KB+", kb);
-  sprintf(buf[3], "%"PRIu64"B", b);
-  selfie_log(s, "[%-20s]: @%12"PRIx64"[%12"PRIx64"] %s%s%s%s",
-      tag, start, size, gb?buf[0]:"", mb?buf[1]:"", kb?buf[2]:"", b?buf[3]:"");
-#endif
-  return;
+  return (nr_zones * sizeof(struct SelfieZoneInfo)) / SELFIE_PAGE_SIZE + 1;
 }
 
+// "none", "trim" or "zero"
+  static int
+layout_parse_init(const char * const opt, uint64_t * const init_type)
+{
+  if (strcmp(opt, "zero") == 0) {
+    *init_type = INIT_ZERO;
+  } else if (strcmp(opt, "trim") == 0) {
+    *init_type = INIT_TRIM;
+  } else if (strcmp(opt, "none") == 0) {
+    *init_type = INIT_NONE;
+  } else {
+    return -EINVAL;
+  }
+  return 0;
+}
 // }}}
 // {{{ image read/write
+// the file holding pa: metadata may be placed in s->meta
+  static inline BlockDriverState *
+image_file(struct SelfieState * const s, const uint64_t pa)
+{
+  if (s->meta == NULL) return s->main;
+  const uint64_t pa_zones_end = s->header.pa_zones + (s->header.nr_zones * s->header.zone_size);
+  if ((pa < s->header.pa_zones) || (pa >= pa_zones_end)) {
+    return s->meta; // zone info, l1
+  }
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  return (s->zones[id].t == ZONE_TYPE_L) ? s->meta : s->main;
+}
+
 // read n 4KB page from image
 // buf should be aligned by 4KB
 // return number of bytes read
   static int
 image_pread(struct SelfieState * const s, const uint64_t pa, void * const buf, const uint64_t len)
 {
-  selfie_log_addr(s, "|---->R_IMAGE", pa, len);
+  trace_selfie_image_pread(s, pa, len);
   assert((pa % SELFIE_PAGE_SIZE) == 0);
   assert((len % SELFIE_PAGE_SIZE) == 0);
-  const int rr = bdrv_pread(s->main, pa, buf, len);
+  const int rr = bdrv_pread(image_file(s, pa), pa, buf, len);
   if (rr != len) { bzero(buf, len); }
   return (int)len;
 }
 
+// drop buffered readahead data overlapping [pa, pa + len)
+  static inline void
+ra_invalidate(struct SelfieState * const s, const uint64_t pa, const uint64_t len)
+{
+  struct SelfieReadahead * const ra = &(s->ra);
+  if (ra->valid && (pa < (ra->pa + ra->len)) && (ra->pa < (pa + len))) {
+    ra->valid = false;
+  }
+  if (ra->filling && (pa < (ra->fill_pa + ra->fill_len)) && (ra->fill_pa < (pa + len))) {
+    ra->fill_valid = false;
+  }
+}
+
 // return number of bytes written
   static int
 image_pwrite(struct SelfieState * const s, const uint64_t pa, const void * const buf, const uint64_t len)
 {
-  selfie_log_addr(s, "|---->W_IMAGE", pa, len);
+  trace_selfie_image_pwrite(s, pa, len);
+  ra_invalidate(s, pa, len);
   assert((pa % SELFIE_PAGE_SIZE) == 0);
   assert((len % SELFIE_PAGE_SIZE) == 0);
-  return bdrv_pwrite(s->main, pa, buf, len);
+  const int rw = bdrv_pwrite(image_file(s, pa), pa, buf, len);
+  // a refill issued while the write was in flight may have read the old data
+  ra_invalidate(s, pa, len);
+  return rw;
 }
 // }}}
 // {{{ zpage coding
@@ -183,11 +396,14 @@ zpage_encode(struct SelfieState * const s, const uint8_t * const raw, struct Sel
 {
   assert(zpage);
   zpage->zh.va = va;
+  atomic_inc(&(s->nr_compress));
   const int r = LZ4_compress_default((const char *)raw, (char *)(zpage->zh.zdata), SELFIE_PAGE_SIZE, s->zdata_size);
+  trace_selfie_compress(s, va, r);
   if (r == 0) {
     return false;
   } else {
     zpage->zh.zsize = (typeof(zpage->zh.zsize))r;
+    atomic_inc(&(s->nr_compress_hit));
     return true;
   }
 }
@@ -199,6 +415,7 @@ zpage_decode(struct SelfieState * const s, uint8_t * const raw, const struct Sel
   if (zpage->zh.zsize == 0) return false;
   assert(zpage->zh.zsize <= s->zdata_size);
   assert(zpage->zh.va < s->header.capacity);
+  trace_selfie_decompress(s, zpage->zh.va, zpage->zh.zsize);
   const int r = LZ4_decompress_safe((char *)(zpage->zh.zdata), (char *)raw, zpage->zh.zsize, SELFIE_PAGE_SIZE);
   assert(r == SELFIE_PAGE_SIZE);
   return true;
@@ -212,23 +429,26 @@ zone_sync(struct SelfieState * const s, const uint64_t id, const bool sync)
   assert(id < s->header.nr_zones);
   const uint64_t pa = s->header.pa_zi + (sizeof(s->zones[0]) * id);
   if (! s->main->read_only) {
-    selfie_log_addr(s, "*ZONE_SYNC", pa, sizeof(s->zones[0]));
-    const int r = bdrv_pwrite(s->main, pa, &(s->zones[id]), sizeof(s->zones[0]));
+    trace_selfie_zone_sync(s, id, s->zones[id].t, s->zones[id].n);
+    BlockDriverState * const file = image_file(s, pa);
+    const int r = bdrv_pwrite(file, pa, &(s->zones[id]), sizeof(s->zones[0]));
     assert(r == sizeof(s->zones[0]));
-    if (sync && s->main->enable_write_cache) {
-      bdrv_flush(s->main);
+    if (sync && file->enable_write_cache) {
+      bdrv_flush(file);
     }
   }
   atomic_inc(&(s->nr_write_zone));
 }
 
-// claim a unused zone to the given type and write to the image
+// claim a unused zone to the given type and class and write to the image
   static void
-zone_mark_sync(struct SelfieState * const s, const uint64_t id, const uint32_t type)
+zone_mark_sync(struct SelfieState * const s, const uint64_t id, const uint32_t type, const uint32_t cls)
 {
-  selfie_log(s, "zone_marked: %u (type:%u (0znl))", id, type);
+  trace_selfie_zone_alloc(s, id, type);
   s->zones[id].t = type;
+  s->zones[id].c = cls;
   s->zones[id].n = 0;
+  atomic_inc(&(s->nr_zones_of[type]));
   zone_sync(s, id, false);
 }
 
@@ -239,20 +459,21 @@ zone_write_zeroes(struct SelfieState * const s, const uint64_t id)
   if (s->main->read_only) return;
   const uint64_t size = s->header.zone_size;
   const uint64_t pa = s->header.pa_zones + (id * size);
-  selfie_log_addr(s, "*ZONE_INIT", pa, size);
+  BlockDriverState * const file = image_file(s, pa);
+  trace_selfie_zone_init(s, id, s->header.init_type);
   switch (s->header.init_type) {
     case INIT_NONE:
       break;
     case INIT_ZERO:
       {
-        const int r = bdrv_write_zeroes(s->main, pa>>9, size>>9, 0);
+        const int r = bdrv_write_zeroes(file, pa>>9, size>>9, 0);
         assert(r == 0);
-        bdrv_flush(s->main);
+        bdrv_flush(file);
       }
       break;
     case INIT_TRIM:
       {
-        const int r = bdrv_discard(s->main, pa>>9, size>>9);
+        const int r = bdrv_discard(file, pa>>9, size>>9);
         assert(r == 0);
       }
       break;
@@ -260,34 +481,57 @@ zone_write_zeroes(struct SelfieState * const s, const uint64_t id)
   }
 }
 
-// alloc a zone of given type
-// find a 0,  convert to Z/N
-  static bool
-zone_alloc_type(struct SelfieState * const s, const uint32_t type)
+// claim an unused zone for the given type
+// data zones leave SELFIE_ZONE_RESERVE unused zones so that the index can still grow
+// returns nr_zones if there is none left
+  static uint64_t
+zone_alloc_type(struct SelfieState * const s, const uint32_t type, const uint32_t cls)
 {
-  uint64_t start = 0;
-  switch (type) {
-    case ZONE_TYPE_Z: start = s->id_zzone; break;
-    case ZONE_TYPE_N: start = s->id_nzone; break;
-    case ZONE_TYPE_L: start = s->id_lzone; break;
-    default: assert(false); break;
-  }
   const uint64_t nr_zones = s->header.nr_zones;
+  const uint64_t reserve = (type == ZONE_TYPE_L) ? 0 : SELFIE_ZONE_RESERVE;
+  __lock(&(s->zone_lock));
+  if (s->nr_zones_free <= reserve) {
+    __unlock(&(s->zone_lock));
+    return nr_zones;
+  }
   uint64_t i;
-  for (i = start; i < nr_zones; i++) {
+  for (i = s->id_free; i < nr_zones; i++) {
     if (s->zones[i].t == ZONE_TYPE_0) { // found unused zone.
-      zone_mark_sync(s, i, type);
-      switch (type) {
-        case ZONE_TYPE_Z: s->id_zzone = i; break;
-        case ZONE_TYPE_N: s->id_nzone = i; break;
-        case ZONE_TYPE_L: s->id_lzone = i; break;
-        default: assert(false); break;
-      }
-      zone_write_zeroes(s, i);
-      return true;
+      zone_mark_sync(s, i, type, cls);
+      s->nr_zones_free--;
+      break;
     }
   }
-  return false;
+  s->id_free = (i < nr_zones) ? (i + 1) : nr_zones;
+  __unlock(&(s->zone_lock));
+  // other streams can claim zones while this one is being initialized
+  if (i < nr_zones) {
+    zone_write_zeroes(s, i);
+  }
+  return i;
+}
+
+// take over a partially used zone of the given type left without a stream on open
+// one of the stream's class is preferred, the zone keeps its class either way
+// returns nr_zones if there is none
+  static uint64_t
+zone_adopt(struct SelfieState * const s, const uint32_t type, const uint32_t cls)
+{
+  uint64_t id = s->header.nr_zones;
+  __lock(&(s->zone_lock));
+  uint64_t i, found = s->nr_orphans;
+  for (i = 0; i < s->nr_orphans; i++) {
+    const struct SelfieZoneInfo * const zi = &(s->zones[s->orphans[i]]);
+    if (zi->t != type) continue;
+    if ((found == s->nr_orphans) || (zi->c == cls)) found = i;
+    if (zi->c == cls) break;
+  }
+  if (found < s->nr_orphans) {
+    id = s->orphans[found];
+    s->orphans[found] = s->orphans[--s->nr_orphans];
+  }
+  __unlock(&(s->zone_lock));
+  return id;
 }
 
   static inline uint64_t
@@ -313,6 +557,14 @@ zone_pa_type(struct SelfieState * const s, const uint64_t pa)
   return s->zones[id].t;
 }
 
+// stream class of the zone holding pa
+  static inline uint64_t
+zone_pa_cls(struct SelfieState * const s, const uint64_t pa)
+{
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  return s->zones[id].c;
+}
+
 #if 0
   static const char *
 zone_pa_type_str(struct SelfieState * const s, const uint64_t pa)
@@ -327,69 +579,493 @@ zone_pa_type_str(struct SelfieState * const s, const uint64_t pa)
 }
 #endif
 
+// take up to want consecutive units from the stream's zone, opening a new zone if it is full
+// orphaned partial zones are used up before unused zones are claimed
+// *got is set to the number of units taken
+// returns 0 if the zone is full and there is no zone left
   static uint64_t
-zone_alloc_z(struct SelfieState * const s, const uint64_t va_hint)
+zone_stream_alloc(struct SelfieState * const s, struct SelfieStream * const st,
+    const uint32_t type, const uint64_t nr_units, const uint64_t want, uint64_t * const got)
 {
-  __lock(&(s->zone_lock));
-  if (s->zones[s->id_zzone].n == s->nr_zone_unit) { // full
-    // TODO: write back index cluster, for fast scanning
-    const bool ra = zone_alloc_type(s, ZONE_TYPE_Z);
-    assert(ra);
+  __lock(&(st->lock));
+  if ((st->id_zone == SELFIE_NO_ZONE) || (s->zones[st->id_zone].n == nr_units)) {
+    // TODO: write back index cluster of a full z-zone, for fast scanning
+    uint64_t id = zone_adopt(s, type, st->cls);
+    if (id == s->header.nr_zones) {
+      id = zone_alloc_type(s, type, st->cls);
+    }
+    if (id == s->header.nr_zones) {
+      __unlock(&(st->lock));
+      return 0;
+    }
+    st->id_zone = id;
   }
-  const uint64_t id_zone = s->id_zzone;
+  const uint64_t id_zone = st->id_zone;
   const uint64_t id_unit = s->zones[id_zone].n;
-  s->zones[id_zone].n++;
-  __unlock(&(s->zone_lock));
+  *got = MIN(want, nr_units - id_unit);
+  s->zones[id_zone].n += *got;
+  atomic_add(&(s->nr_units_of[type]), *got);
+  // units count as live from here: the zone can't be freed before they are mapped
+  if (s->zone_live && (type != ZONE_TYPE_L)) {
+    s->zone_live[id_zone] += *got;
+  }
+  // no update for z-zone: recovered by scanning
+  if (type != ZONE_TYPE_Z) {
+    zone_sync(s, id_zone, false);
+  }
+  __unlock(&(st->lock));
   const uint64_t pa = zone_id_to_pa(s, id_zone, id_unit);
-  assert(zone_pa_type(s, pa) == ZONE_TYPE_Z);
+  assert(zone_pa_type(s, pa) == type);
   return pa;
 }
 
+// clusters under the same l2 page share a stream
+  static inline uint64_t
+zone_stream_id(struct SelfieState * const s, const uint64_t va_hint)
+{
+  return (va_hint >> (s->header.block_shift + 9)) % s->nr_streams;
+}
+
+  static inline uint64_t
+zone_class_streams(struct SelfieState * const s, const uint64_t cls)
+{
+  return (cls == STREAM_RELOC) ? 1 : s->nr_streams;
+}
+
+// alloc up to want consecutive data units from a stream of the class
+// when out of unused zones, fall back to the other streams, then to the other classes
+// returns 0 when the image is out of space
   static uint64_t
-zone_alloc_n(struct SelfieState * const s, const uint64_t va_hint)
+zone_alloc_data(struct SelfieState * const s, const uint32_t type,
+    const uint64_t va_hint, const uint64_t cls, const uint64_t want, uint64_t * const got)
 {
-  __lock(&(s->zone_lock));
-  if (s->zones[s->id_nzone].n == s->nr_zone_unit) {
-    const bool ra = zone_alloc_type(s, ZONE_TYPE_N);
-    assert(ra);
+  struct SelfieStream (* const streams)[SELFIE_MAX_STREAMS] =
+    (type == ZONE_TYPE_Z) ? s->zstreams : s->nstreams;
+  const uint64_t k = zone_stream_id(s, va_hint);
+  uint64_t c, i;
+  for (c = 0; c < SELFIE_NR_CLASSES; c++) {
+    const uint64_t ic = (cls + c) % SELFIE_NR_CLASSES;
+    const uint64_t nr = zone_class_streams(s, ic);
+    for (i = 0; i < nr; i++) {
+      struct SelfieStream * const st = &(streams[ic][(k + i) % nr]);
+      const uint64_t nr_units = (type == ZONE_TYPE_N) ? s->nr_zone_unit_n : s->nr_zone_unit;
+      const uint64_t pa = zone_stream_alloc(s, st, type, nr_units, want, got);
+      if (pa) {
+        if (cls == STREAM_HOT) atomic_add(&(s->nr_alloc_hot), *got);
+        return pa;
+      }
+    }
   }
-  const uint64_t id_zone = s->id_nzone;
-  const uint64_t id_unit = s->zones[id_zone].n;
-  s->zones[id_zone].n++;
-  zone_sync(s, id_zone, false);
-  __unlock(&(s->zone_lock));
-  const uint64_t pa = zone_id_to_pa(s, id_zone, id_unit);
-  assert(zone_pa_type(s, pa) == ZONE_TYPE_N);
-  return pa;
+  return 0; // out of space
+}
+
+  static uint64_t
+zone_alloc_z(struct SelfieState * const s, const uint64_t va_hint, const uint64_t cls)
+{
+  uint64_t got;
+  return zone_alloc_data(s, ZONE_TYPE_Z, va_hint, cls, 1, &got);
+}
+
+  static uint64_t
+zone_alloc_n(struct SelfieState * const s, const uint64_t va_hint, const uint64_t cls)
+{
+  uint64_t got;
+  return zone_alloc_data(s, ZONE_TYPE_N, va_hint, cls, 1, &got);
 }
 
   static uint64_t
 zone_alloc_l(struct SelfieState * const s)
 {
+  // no sync on l-zone counter: scan on loading
+  uint64_t got;
+  const uint64_t pa = zone_stream_alloc(s, &(s->lstream), ZONE_TYPE_L, s->nr_zone_page, 1, &got);
+  assert(pa); // out of space, despite SELFIE_ZONE_RESERVE
+  return pa;
+}
+
+// a stream still on a full zone opens a new one on its next allocation
+  static void
+zone_detach_streams(struct SelfieState * const s, const uint64_t id)
+{
+  uint64_t c, k;
+  for (c = 0; c < SELFIE_NR_CLASSES; c++) {
+    for (k = 0; k < SELFIE_MAX_STREAMS; k++) {
+      if (s->zstreams[c][k].id_zone == id) s->zstreams[c][k].id_zone = SELFIE_NO_ZONE;
+      if (s->nstreams[c][k].id_zone == id) s->nstreams[c][k].id_zone = SELFIE_NO_ZONE;
+    }
+  }
+}
+
+// free a full data zone none of whose units is mapped any more
+// only after the index no longer referring to it is on disk, see zone_reclaim_sync()
+  static void
+zone_reclaim(struct SelfieState * const s, const uint64_t id)
+{
+  const uint32_t type = s->zones[id].t;
+  if (type == ZONE_TYPE_Z) {
+    // the open-time scan must not take stale z-pages for data when the zone is reused
+    const uint64_t pa = s->header.pa_zones + (id * s->header.zone_size);
+    const int r = bdrv_write_zeroes(image_file(s, pa), pa >> 9, s->header.zone_size >> 9, BDRV_REQ_MAY_UNMAP);
+    if (r < 0) return; // the zone stays full and is tried again on the next open
+  }
+  zone_detach_streams(s, id);
   __lock(&(s->zone_lock));
-  if (s->zones[s->id_lzone].n == s->nr_zone_page) {
-    const bool ra = zone_alloc_type(s, ZONE_TYPE_L);
-    assert(ra);
+  trace_selfie_zone_reclaim(s, id, type);
+  atomic_dec(&(s->nr_zones_of[type]));
+  atomic_sub(&(s->nr_units_of[type]), s->zones[id].n);
+  s->zones[id].t = ZONE_TYPE_0;
+  s->zones[id].n = 0;
+  s->zones[id].c = STREAM_COLD;
+  zone_sync(s, id, true);
+  if (s->ncsum && s->ncsum[id]) { // read again if the zone is reused
+    qemu_vfree(s->ncsum[id]);
+    s->ncsum[id] = NULL;
   }
-  const uint64_t id_zone = s->id_lzone;
-  const uint64_t id_unit = s->zones[id_zone].n;
-  s->zones[id_zone].n++;
-  zone_sync(s, id_zone, false);
-  // no sync on l-zone counter: scan on loading
+  s->nr_zones_free++;
+  s->id_free = MIN(s->id_free, id);
+  atomic_inc(&(s->nr_reclaimed));
   __unlock(&(s->zone_lock));
-  const uint64_t pa = zone_id_to_pa(s, id_zone, id_unit);
-  assert(zone_pa_type(s, pa) == ZONE_TYPE_L);
-  return pa;
+}
+
+// a full data zone with no live units left
+  static bool
+zone_reclaimable(struct SelfieState * const s, const uint64_t id)
+{
+  const uint32_t type = s->zones[id].t;
+  if (type == ZONE_TYPE_Z) return (s->zones[id].n == s->nr_zone_unit) && (s->zone_live[id] == 0);
+  if (type == ZONE_TYPE_N) return (s->zones[id].n == s->nr_zone_unit_n) && (s->zone_live[id] == 0);
+  return false;
+}
+
+// the data unit at pa was replaced in the index
+  static void
+zone_release(struct SelfieState * const s, const uint64_t pa)
+{
+  atomic_inc(&(s->nr_leaked));
+  if (s->zone_live == NULL) return;
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  if (s->zone_live[id] > 0) {
+    s->zone_live[id]--;
+  }
+  if (s->zone_live[id] == 0) {
+    s->reclaim_pending = true;
+  }
+}
+
+// zone info of pa in zones (s->zones or a copy), NULL if pa is outside the zones
+  static inline const struct SelfieZoneInfo *
+zone_pa_info(struct SelfieState * const s, const struct SelfieZoneInfo * const zones, const uint64_t pa)
+{
+  if (pa < s->header.pa_zones) return NULL;
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  return (id < s->header.nr_zones) ? &(zones[id]) : NULL;
+}
+
+// true if pa is below the counter of its zone, i.e. it has been handed out
+// counters of n/l-zones are written on every allocation
+  static bool
+zone_pa_allocated(struct SelfieState * const s, const struct SelfieZoneInfo * const zones, const uint64_t pa)
+{
+  const struct SelfieZoneInfo * const zi = zone_pa_info(s, zones, pa);
+  if (zi == NULL) return false;
+  const uint64_t off = (pa - s->header.pa_zones) % s->header.zone_size;
+  const uint64_t unit = (zi->t == ZONE_TYPE_L) ? SELFIE_PAGE_SIZE : s->block_size;
+  return (off / unit) < zi->n;
+}
+// }}}
+// {{{ checksum
+// with SELFIE_F_CHECKSUM every data unit has a crc32c
+// z-units keep it in the last 4 bytes of the head page, covering the rest of the unit
+// n-zones keep a table of them in units reserved at the zone tail
+
+  static inline bool
+csum_enabled(struct SelfieState * const s)
+{
+  return (s->header.flags & SELFIE_F_CHECKSUM) != 0;
+}
+
+  static inline uint32_t *
+csum_z_slot(const uint8_t * const head)
+{
+  return (uint32_t *)&(head[SELFIE_PAGE_SIZE - sizeof(uint32_t)]);
+}
+
+// crc32c of a z-unit: the head page without its checksum slot, then the raw tail
+  static uint32_t
+csum_z(struct SelfieState * const s, const uint8_t * const head, const uint8_t * const tail)
+{
+  const uint32_t c = crc32c(0xffffffff, head, SELFIE_PAGE_SIZE - sizeof(uint32_t)) ^ 0xffffffff;
+  return crc32c(c, tail, s->block_size - SELFIE_PAGE_SIZE);
+}
+
+// stamp a z-unit before writing it
+  static void
+csum_z_seal(struct SelfieState * const s, uint8_t * const head, const uint8_t * const tail)
+{
+  if (!csum_enabled(s)) return;
+  *csum_z_slot(head) = csum_z(s, head, tail);
+}
+
+  static bool
+csum_z_check(struct SelfieState * const s, const uint8_t * const head, const uint8_t * const tail)
+{
+  if (!csum_enabled(s)) return true;
+  return *csum_z_slot(head) == csum_z(s, head, tail);
+}
+
+// units at the tail of a n-zone holding its checksum table
+  static inline uint64_t
+csum_table_units(struct SelfieState * const s)
+{
+  return DIV_ROUND_UP(s->nr_zone_unit * sizeof(uint32_t), s->block_size);
+}
+
+// checksum table of n-zone id
+  static uint32_t *
+csum_n_table(struct SelfieState * const s, const uint64_t id)
+{
+  if (s->ncsum[id] == NULL) {
+    const uint64_t size = csum_table_units(s) * s->block_size;
+    uint32_t * const table = qemu_blockalign(s->main, size);
+    const uint64_t pa = zone_id_to_pa(s, id, s->nr_zone_unit_n);
+    const int rr = image_pread(s, pa, table, size);
+    assert(rr == size);
+    if (s->ncsum[id] == NULL) {
+      s->ncsum[id] = table;
+    } else { // loaded by another request while reading
+      qemu_vfree(table);
+    }
+  }
+  return s->ncsum[id];
+}
+
+// record the checksum of the n-unit at pa after writing buf to it
+// the table page holding the entry is rewritten as a whole: image writes are
+// page aligned. csum_lock keeps a page written with an older table from
+// landing after a newer one
+  static void
+csum_n_update(struct SelfieState * const s, const uint64_t pa, const uint8_t * const buf)
+{
+  if (!csum_enabled(s)) return;
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  const uint64_t unit = ((pa - s->header.pa_zones) % s->header.zone_size) / s->block_size;
+  assert(unit < s->nr_zone_unit_n);
+  uint32_t * const table = csum_n_table(s, id);
+  const uint32_t crc = crc32c(0xffffffff, buf, s->block_size);
+  const uint64_t off = QEMU_ALIGN_DOWN(unit * sizeof(uint32_t), SELFIE_PAGE_SIZE);
+  const uint64_t pa_csum = zone_id_to_pa(s, id, s->nr_zone_unit_n) + off;
+  __lock(&(s->csum_lock));
+  table[unit] = crc;
+  const int rw = image_pwrite(s, pa_csum, ((uint8_t *)table) + off, SELFIE_PAGE_SIZE);
+  __unlock(&(s->csum_lock));
+  assert(rw == SELFIE_PAGE_SIZE);
+}
+
+  static bool
+csum_n_check(struct SelfieState * const s, const uint64_t pa, const uint8_t * const buf)
+{
+  if (!csum_enabled(s)) return true;
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  const uint64_t unit = ((pa - s->header.pa_zones) % s->header.zone_size) / s->block_size;
+  const uint32_t * const table = csum_n_table(s, id);
+  return table[unit] == crc32c(0xffffffff, buf, s->block_size);
+}
+
+// SELFIE_F_DIRTY is on disk before the first in-place n-unit write of a session
+// and cleared on close, once everything is on disk
+  static int
+csum_mark_dirty(struct SelfieState * const s, const bool dirty)
+{
+  if ((!csum_enabled(s)) || s->main->read_only) return 0;
+  if (((s->header.flags & SELFIE_F_DIRTY) != 0) == dirty) return 0;
+  struct SelfieHeader nh = s->header;
+  if (dirty) {
+    nh.flags |= SELFIE_F_DIRTY;
+  } else {
+    nh.flags &= ~SELFIE_F_DIRTY;
+  }
+  const int rh = bdrv_pwrite_sync(s->main, 0, &nh, sizeof(nh));
+  if (rh < 0) return rh;
+  s->header.flags = nh.flags; // set once written: concurrent writers wait for their own
+  return 0;
+}
+
+  static void
+csum_free(struct SelfieState * const s)
+{
+  if (s->ncsum == NULL) return;
+  uint64_t i;
+  for (i = 0; i < s->header.nr_zones; i++) {
+    qemu_vfree(s->ncsum[i]);
+  }
+  g_free(s->ncsum);
+  s->ncsum = NULL;
 }
 // }}}
 // {{{ index mapping
+// checks of on-disk entries, zones is the zone info as it was at open
+
+// true if pa (from index_translate) points to a data unit
+  static inline bool
+index_pa_data(const uint64_t pa)
+{
+  return (pa != 0) && (pa != SELFIE_PA_ZERO);
+}
+
+// l2 entry: n-units beyond the zone counter were never written
+  static bool
+index_l2_entry_valid(struct SelfieState * const s, const struct SelfieZoneInfo * const zones, const uint64_t pa)
+{
+  if (pa == SELFIE_PA_ZERO) return true;
+  const struct SelfieZoneInfo * const zi = zone_pa_info(s, zones, pa);
+  if (zi == NULL) return false;
+  return (zi->t == ZONE_TYPE_Z) || ((zi->t == ZONE_TYPE_N) && zone_pa_allocated(s, zones, pa));
+}
+
+// l1 entry: an allocated l2 page, or an extent whose units were all allocated
+  static bool
+index_l1_entry_valid(struct SelfieState * const s, const struct SelfieZoneInfo * const zones, const uint64_t pa)
+{
+  if (pa & L1_EXTENT) {
+    const uint64_t base = pa & ~L1_EXTENT;
+    const uint64_t last = base + (511 * s->block_size);
+    const struct SelfieZoneInfo * const zi = zone_pa_info(s, zones, base);
+    return zi && (zi->t == ZONE_TYPE_N) && (zone_pa_info(s, zones, last) == zi)
+      && zone_pa_allocated(s, zones, last);
+  }
+  const struct SelfieZoneInfo * const zi = zone_pa_info(s, zones, pa);
+  return zi && (zi->t == ZONE_TYPE_L) && zone_pa_allocated(s, zones, pa);
+}
+
+// clear invalid entries of a l2 page, true if any was cleared
+  static bool
+index_l2_sanitize(struct SelfieState * const s, const struct SelfieZoneInfo * const zones,
+    uint64_t * const l2_page, const bool dry_run)
+{
+  bool changed = false;
+  uint64_t k;
+  for (k = 0; k < 512; k++) {
+    if (l2_page[k] && (!index_l2_entry_valid(s, zones, l2_page[k]))) {
+      if (dry_run) return true;
+      l2_page[k] = 0;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// copy the l1 page out of the mapping before changing it
+  static void
+index_own_l1(struct SelfieState * const s, struct SelfieIndexL1 * const node)
+{
+  if (!node->mapped1) return;
+  uint64_t * const page = aligned_alloc(SELFIE_PAGE_SIZE, SELFIE_PAGE_SIZE);
+  assert(page);
+  atomic_inc(&(s->nr_index_pages));
+  memcpy(page, node->l1_page, SELFIE_PAGE_SIZE);
+  node->l1_page = page;
+  node->mapped1 = false;
+}
+
+// copy a l2 page out of the mapping before changing it
+  static void
+index_own_l2(struct SelfieState * const s, struct SelfieIndexL1 * const node, const uint64_t id_l2)
+{
+  if (!node->mapped2[id_l2]) return;
+  uint64_t * const page = aligned_alloc(SELFIE_PAGE_SIZE, SELFIE_PAGE_SIZE);
+  assert(page);
+  atomic_inc(&(s->nr_index_pages));
+  memcpy(page, node->l2_pages[id_l2], SELFIE_PAGE_SIZE);
+  node->l2_pages[id_l2] = page;
+  node->mapped2[id_l2] = false;
+}
+
+// validate l1 entry id_l2 of node on first use and point its l2 into the mapping
+// pages are faulted in by the kernel when an entry is read
+// no yield: safe to call from translation
+  static void
+index_resolve(struct SelfieState * const s, struct SelfieIndexL1 * const node, const uint64_t id_l2)
+{
+  if (node->checked[id_l2] || (s->imap == NULL)) return;
+  node->checked[id_l2] = true;
+  const uint64_t pa_l2 = node->l1_page[id_l2];
+  if (pa_l2 == 0) return;
+  if ((!index_l1_entry_valid(s, s->zones_open, pa_l2))
+      || ((!(pa_l2 & L1_EXTENT)) && ((pa_l2 + SELFIE_PAGE_SIZE) > s->imap_size))) {
+    index_own_l1(s, node);
+    node->l1_page[id_l2] = 0; // invalid pa_l2
+    return;
+  }
+  if (pa_l2 & L1_EXTENT) return;
+  node->l2_pages[id_l2] = (uint64_t *)(s->imap + pa_l2);
+  node->mapped2[id_l2] = true;
+  if (index_l2_sanitize(s, s->zones_open, node->l2_pages[id_l2], true)) {
+    index_own_l2(s, node, id_l2);
+    index_l2_sanitize(s, s->zones_open, node->l2_pages[id_l2], false);
+  }
+}
+
 // alloc l2 page in image file
   static uint64_t
 index_l2_alloc(struct SelfieState * const s)
 {
-  const uint64_t pa = zone_alloc_l(s);
-  selfie_log_addr(s, "*L2_ALLOC", pa, SELFIE_PAGE_SIZE);
-  return pa;
+  return zone_alloc_l(s);
+}
+
+// base pa if all entries of the l2 are contiguous units in one n-zone, 0 otherwise
+  static uint64_t
+index_l2_extent_base(struct SelfieState * const s, const uint64_t * const l2_page)
+{
+  const uint64_t base = l2_page[0];
+  if ((!index_pa_data(base)) || (zone_pa_type(s, base) != ZONE_TYPE_N)) return 0;
+  const uint64_t last = base + (511 * s->block_size);
+  const uint64_t id_zone = (base - s->header.pa_zones) / s->header.zone_size;
+  if (((last - s->header.pa_zones) / s->header.zone_size) != id_zone) return 0;
+  uint64_t k;
+  for (k = 1; k < 512; k++) {
+    if (l2_page[k] != (base + (k * s->block_size))) return 0;
+  }
+  return base;
+}
+
+// replace a contiguous l2 by an extent entry in l1 and release the l2 page
+// called with node->write_lock held
+  static bool
+index_l2_to_extent(struct SelfieState * const s, struct SelfieIndexL1 * const node, const uint64_t id_l2)
+{
+  uint64_t * const l2_page = node->l2_pages[id_l2];
+  assert(l2_page);
+  const uint64_t base = index_l2_extent_base(s, l2_page);
+  if (base == 0) return false;
+  index_own_l1(s, node);
+  node->l1_page[id_l2] = base | L1_EXTENT;
+  node->l2_pages[id_l2] = NULL;
+  node->dirty2[id_l2] = false;
+  node->dirty1 = true;
+  if (node->mapped2[id_l2]) {
+    node->mapped2[id_l2] = false;
+  } else {
+    free(l2_page);
+    atomic_dec(&(s->nr_index_pages));
+  }
+  return true;
+}
+
+// expand an extent into an in-memory l2 before changing one of its entries
+// the l1 entry is cleared, a new l2 page is allocated when it is written
+  static void
+index_extent_to_l2(struct SelfieState * const s, struct SelfieIndexL1 * const node,
+    const uint64_t id_l2, uint64_t * const l2_page)
+{
+  const uint64_t base = node->l1_page[id_l2] & ~L1_EXTENT;
+  uint64_t k;
+  for (k = 0; k < 512; k++) {
+    l2_page[k] = base + (k * s->block_size);
+  }
+  index_own_l1(s, node);
+  node->l1_page[id_l2] = 0;
+  node->dirty1 = true;
+  node->dirty2[id_l2] = true;
 }
 
   static void
@@ -400,18 +1076,23 @@ index_write_id(struct SelfieState * const s, const uint64_t id_l1, const uint64_
   assert(id_l2 < 512);
   struct SelfieIndexL1 * const node = &(s->nodes[id_l1]);
   __lock(&(node->write_lock));
-  if (node->dirty2[id_l2]) {
+  if (node->dirty2[id_l2] && index_l2_to_extent(s, node, id_l2)) {
+    // l1 only: the l2 page on disk (if any) is no longer referenced
+    trace_selfie_extent(s, id_l1, id_l2, node->l1_page[id_l2] & ~L1_EXTENT);
+  } else if (node->dirty2[id_l2]) {
     if (node->l1_page[id_l2] == 0) { // need alloc
+      index_own_l1(s, node);
       // set pa of l2 in l1
       node->l1_page[id_l2] = index_l2_alloc(s);
       node->dirty1 = true;
+      trace_selfie_alloc_l2(s, id_l1, id_l2, node->l1_page[id_l2]);
     }
     const uint64_t pa_l2 = node->l1_page[id_l2];
     assert(zone_pa_type(s, pa_l2) == ZONE_TYPE_L);
     assert(node->l2_pages[id_l2]);
     const int rw = image_pwrite(s, pa_l2, node->l2_pages[id_l2], SELFIE_PAGE_SIZE);
     assert(rw == SELFIE_PAGE_SIZE);
-    selfie_log_addr(s, "*L2_WRITE", node->l1_page[id_l2], SELFIE_PAGE_SIZE);
+    trace_selfie_write_l2(s, id_l1, id_l2, pa_l2);
     atomic_inc(&(s->nr_write_l2));
     // clear  dirty2
     node->dirty2[id_l2] = false;
@@ -423,7 +1104,7 @@ index_write_id(struct SelfieState * const s, const uint64_t id_l1, const uint64_
     const uint64_t pa_l1 = s->header.pa_l1 + (id_l1 * SELFIE_PAGE_SIZE);
     const int rw = image_pwrite(s, pa_l1, node->l1_page, SELFIE_PAGE_SIZE);
     assert(rw == SELFIE_PAGE_SIZE);
-    selfie_log_addr(s, "*L1_WRITE", pa_l1, SELFIE_PAGE_SIZE);
+    trace_selfie_write_l1(s, id_l1, pa_l1);
     atomic_inc(&(s->nr_write_l1));
     node->dirty1 = false;
   }
@@ -445,16 +1126,26 @@ index_map(struct SelfieState * const s, const uint64_t va, const uint64_t pa, co
 
   struct SelfieIndexL1 * const node = &(s->nodes[id_l1]);
   assert(node->l1_page);
+  index_resolve(s, node, id_l2);
+  index_own_l2(s, node, id_l2);
   // alloc if no l2 in memory
   if (node->l2_pages[id_l2] == NULL) { // alloc l2
     uint64_t * const l2_page = aligned_alloc(SELFIE_PAGE_SIZE, SELFIE_PAGE_SIZE);
     assert(l2_page);
-    bzero(l2_page, SELFIE_PAGE_SIZE);
+    atomic_inc(&(s->nr_index_pages));
+    if (node->l1_page[id_l2] & L1_EXTENT) { // split
+      trace_selfie_extent_split(s, va, node->l1_page[id_l2] & ~L1_EXTENT);
+      index_extent_to_l2(s, node, id_l2, l2_page);
+    } else {
+      bzero(l2_page, SELFIE_PAGE_SIZE);
+    }
     node->l2_pages[id_l2] = l2_page;
   }
 
   // check if changed (likely)
-  if (node->l2_pages[id_l2][id_pg] != pa) {
+  const uint64_t pa_old = node->l2_pages[id_l2][id_pg];
+  if (pa_old != pa) {
+    trace_selfie_remap(s, va, pa_old, pa);
     node->l2_pages[id_l2][id_pg] = pa;
     node->dirty2[id_l2] = true;
   }
@@ -463,6 +1154,10 @@ index_map(struct SelfieState * const s, const uint64_t va, const uint64_t pa, co
   if (write) { // write mapping
     index_write_id(s, id_l1, id_l2);
   }
+  // the old unit lost its data, its zone is freed on a later flush
+  if ((pa_old != pa) && index_pa_data(pa_old)) {
+    zone_release(s, pa_old);
+  }
   __unlock(&(s->index_lock[va_lock_id]));
 }
 
@@ -478,18 +1173,75 @@ index_map_hard(struct SelfieState * const s, const uint64_t va, const uint64_t p
   index_map(s, va, pa, true);
 }
 
-  static uint64_t
-index_translate(struct SelfieState * const s, const uint64_t va)
+// write every dirty l2 page and l1 page of the index
+  static void
+index_flush(struct SelfieState * const s)
 {
-  assert((va % s->block_size) == 0);
-  const uint64_t spg = s->header.block_shift;
+  uint64_t i, j;
+  for (i = 0; i < s->header.nr_l1; i++) {
+    struct SelfieIndexL1 * const node = &(s->nodes[i]);
+    for (j = 0; j < 512; j++) {
+      if (node->dirty2[j]) {
+        index_write_id(s, i, j);
+      }
+    }
+    if (node->dirty1) { // l1 only
+      index_write_id(s, i, 0);
+    }
+  }
+}
+
+// free the zones emptied so far
+// zones are picked before the index is written: a unit released after that
+// (e.g. by a soft mapping) keeps its zone for the next round
+  static int coroutine_fn
+zone_reclaim_sync(struct SelfieState * const s)
+{
+  if ((!s->reclaim_pending) || s->main->read_only) return 0;
+  s->reclaim_pending = false;
+  const uint64_t nr_zones = s->header.nr_zones;
+  uint64_t * const ids = g_new(uint64_t, nr_zones);
+  uint64_t nr = 0;
+  uint64_t i;
+  for (i = 0; i < nr_zones; i++) {
+    if (zone_reclaimable(s, i)) ids[nr++] = i;
+  }
+  int ret = 0;
+  if (nr) {
+    index_flush(s);
+    ret = bdrv_co_flush(s->main);
+    if ((ret == 0) && s->meta) {
+      ret = bdrv_co_flush(s->meta);
+    }
+  }
+  if (ret < 0) {
+    s->reclaim_pending = true;
+  } else {
+    for (i = 0; i < nr; i++) {
+      zone_reclaim(s, ids[i]);
+    }
+  }
+  g_free(ids);
+  return ret;
+}
+
+  static uint64_t
+index_translate(struct SelfieState * const s, const uint64_t va)
+{
+  assert((va % s->block_size) == 0);
+  const uint64_t spg = s->header.block_shift;
   const uint64_t id_l1 = (va >> (spg + 18));
   const uint64_t id_l2 = (va >> (spg + 9)) & 0x1ff;
   const uint64_t id_pg = (va >> spg) & 0x1ff;
-  if ((id_l1 < s->header.nr_l1) && (s->nodes[id_l1].l2_pages[id_l2])) {
-    const uint64_t pa = s->nodes[id_l1].l2_pages[id_l2][id_pg];
+  if (id_l1 >= s->header.nr_l1) return 0;
+  struct SelfieIndexL1 * const node = &(s->nodes[id_l1]);
+  index_resolve(s, node, id_l2);
+  if (node->l2_pages[id_l2]) {
+    const uint64_t pa = node->l2_pages[id_l2][id_pg];
     assert((pa % SELFIE_PAGE_SIZE) == 0);
     return pa;
+  } else if (node->l1_page && (node->l1_page[id_l2] & L1_EXTENT)) {
+    return (node->l1_page[id_l2] & ~L1_EXTENT) + (id_pg * s->block_size);
   } else {
     // 0 == no mapping
     return 0;
@@ -502,12 +1254,76 @@ index_node_free(struct SelfieIndexL1 * const node)
   if (node == NULL) return;
   uint64_t i;
   for (i = 0; i < 512; i++) {
-    if (node->l2_pages[i]) free(node->l2_pages[i]);
+    if (node->l2_pages[i] && (!node->mapped2[i])) free(node->l2_pages[i]);
+    g_free(node->heat[i]);
   }
-  if (node->l1_page) free(node->l1_page);
+  if (node->l1_page && (!node->mapped1)) free(node->l1_page);
   // don't free(node)
 }
 
+// map the file holding l1 and l-zones read-only
+// only for a host file: the protocol driver must be "file"
+  static int
+index_map_file(struct SelfieState * const s, Error **errp)
+{
+  BlockDriverState * const file = s->meta ? s->meta : s->main;
+  if ((file->drv == NULL) || strcmp(file->drv->format_name, "file")) {
+    error_setg(errp, "mmap-index requires the index to be stored in a host file");
+    return -ENOTSUP;
+  }
+  const int fd = qemu_open(file->filename, O_RDONLY);
+  if (fd < 0) {
+    error_setg_errno(errp, errno, "Could not open '%s'", file->filename);
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    const int ret = -errno;
+    error_setg_errno(errp, errno, "Could not stat '%s'", file->filename);
+    qemu_close(fd);
+    return ret;
+  }
+  const uint64_t size = st.st_size;
+  if (size < (s->header.pa_l1 + (s->header.nr_l1 * SELFIE_PAGE_SIZE))) {
+    error_setg(errp, "'%s' is too short for its index", file->filename);
+    qemu_close(fd);
+    return -EINVAL;
+  }
+  void * const addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  const int ret = -errno;
+  qemu_close(fd); // the mapping holds its own reference
+  if (addr == MAP_FAILED) {
+    error_setg_errno(errp, -ret, "Could not mmap '%s'", file->filename);
+    return ret;
+  }
+  s->imap = addr;
+  s->imap_size = size;
+  s->zones_open = g_memdup(s->zones, sizeof(s->zones[0]) * s->header.nr_zones);
+  return 0;
+}
+
+// copy every mapped page and drop the mapping (before the layout changes)
+  static void
+index_unmap(struct SelfieState * const s)
+{
+  if (s->imap == NULL) return;
+  uint64_t i, j;
+  for (i = 0; i < s->header.nr_l1; i++) {
+    struct SelfieIndexL1 * const node = &(s->nodes[i]);
+    if (node->l1_page == NULL) continue;
+    for (j = 0; j < 512; j++) {
+      index_resolve(s, node, j);
+      index_own_l2(s, node, j);
+    }
+    index_own_l1(s, node);
+  }
+  munmap(s->imap, s->imap_size);
+  s->imap = NULL;
+  s->imap_size = 0;
+  g_free(s->zones_open);
+  s->zones_open = NULL;
+}
+
   static void
 index_free(struct SelfieState * const s)
 {
@@ -520,25 +1336,184 @@ index_free(struct SelfieState * const s)
   s->nodes = NULL;
 }
 
+// walks the whole address space: only when the tracepoint is enabled
   static void
 index_mapping_print(struct SelfieState * const s, const char * const tag)
 {
+  if (!trace_event_get_state(TRACE_SELFIE_MAPPINGS)) return;
   uint64_t cz = 0;
   uint64_t cn = 0;
   uint64_t cx = 0;
   uint64_t va;
   for (va = 0; va < s->header.capacity; va += s->block_size) {
     const uint64_t pa = index_translate(s, va);
-    if (pa) {
+    if (index_pa_data(pa)) {
       switch (zone_pa_type(s, pa)) {
         case ZONE_TYPE_Z: cz++; break;
         case ZONE_TYPE_N: cn++; break;
         default: cx++; break;
       }
-      //selfie_log(s, "%s-MAPPING@%016"PRIx64"->%016"PRIx64" %s", tag, va, pa, zone_pa_type_str(s, pa));
     }
   }
-  selfie_log(s, "%s mappings: %"PRIu64"Z, %"PRIu64"N, %"PRIu64"?", tag, cz, cn, cx);
+  trace_selfie_mappings(s, tag, cz, cn, cx);
+}
+// }}}
+// {{{ write heat
+// count a write to the cluster at va and return its temperature
+// an epoch ends every HEAT_EPOCH_WRITES cluster writes, counters of a l2 page
+// are halved for each epoch passed since they were last touched
+  static uint64_t
+heat_update(struct SelfieState * const s, const uint64_t va)
+{
+  const uint64_t spg = s->header.block_shift;
+  const uint64_t id_l1 = (va >> (spg + 18));
+  const uint64_t id_l2 = (va >> (spg + 9)) & 0x1ff;
+  const uint64_t id_pg = (va >> spg) & 0x1ff;
+  assert(id_l1 < s->header.nr_l1);
+  const uint64_t epoch = atomic_fetch_inc(&(s->nr_heat_writes)) / HEAT_EPOCH_WRITES;
+  struct SelfieIndexL1 * const node = &(s->nodes[id_l1]);
+  struct SelfieHeat * heat = node->heat[id_l2];
+  if (heat == NULL) { // no yield between the check and the store
+    heat = g_new0(struct SelfieHeat, 1);
+    heat->epoch = epoch;
+    node->heat[id_l2] = heat;
+    atomic_inc(&(s->nr_index_heat));
+  }
+  if (heat->epoch < epoch) {
+    const uint64_t shift = MIN(epoch - heat->epoch, 8);
+    uint64_t k;
+    for (k = 0; k < 512; k++) {
+      heat->c[k] >>= shift;
+    }
+    heat->epoch = epoch;
+  }
+  if (heat->c[id_pg] < HEAT_MAX) heat->c[id_pg]++;
+  return heat->c[id_pg];
+}
+
+// temperature without counting a write (for relocation)
+  static uint64_t
+heat_get(struct SelfieState * const s, const uint64_t va)
+{
+  const uint64_t spg = s->header.block_shift;
+  const uint64_t id_l1 = (va >> (spg + 18));
+  const uint64_t id_l2 = (va >> (spg + 9)) & 0x1ff;
+  const uint64_t id_pg = (va >> spg) & 0x1ff;
+  const struct SelfieHeat * const heat = s->nodes[id_l1].heat[id_l2];
+  if (heat == NULL) return 0;
+  const uint64_t epoch = atomic_read(&(s->nr_heat_writes)) / HEAT_EPOCH_WRITES;
+  const uint64_t shift = MIN(epoch - heat->epoch, 8);
+  return heat->c[id_pg] >> shift;
+}
+
+  static inline uint64_t
+heat_class(const uint64_t heat)
+{
+  return (heat >= HEAT_HOT) ? STREAM_HOT : STREAM_COLD;
+}
+// }}}
+// {{{ readahead
+  static inline bool
+ra_contains(const struct SelfieReadahead * const ra, const uint64_t pa, const uint64_t len)
+{
+  return ra->valid && (pa >= ra->pa) && ((pa + len) <= (ra->pa + ra->len));
+}
+
+// allocated clusters from pa to the end of its zone
+  static uint64_t
+ra_zone_remain(struct SelfieState * const s, const uint64_t pa)
+{
+  const uint64_t id = (pa - s->header.pa_zones) / s->header.zone_size;
+  const uint64_t pa_base = s->header.pa_zones + (id * s->header.zone_size);
+  const uint64_t unit = (pa - pa_base) / s->block_size;
+  const uint64_t n = s->zones[id].n;
+  return (n > unit) ? (n - unit) : 0;
+}
+
+// serve a cluster read at pa from the readahead buffer
+// a sequential miss refills the buffer with the next physically contiguous clusters;
+// the refill is read into the stage buffer without the lock, so other reads keep
+// being served (or go to the image) meanwhile, and published when complete
+// return false if the caller has to read the image
+  static bool
+ra_read(struct SelfieState * const s, const uint64_t pa, uint8_t * const buf)
+{
+  struct SelfieReadahead * const ra = &(s->ra);
+  if (ra->max_window == 0) return false;
+  const uint64_t bs = s->block_size;
+  __lock(&(ra->lock));
+  if (ra_contains(ra, pa, bs)) {
+    memcpy(buf, &(ra->buf[pa - ra->pa]), bs);
+    ra->last_pa = pa;
+    __unlock(&(ra->lock));
+    return true;
+  }
+
+  const bool seq = (pa == (ra->last_pa + bs));
+  ra->last_pa = pa;
+  if (!seq) { // random access, shrink the window
+    ra->window = MIN(RA_MIN_WINDOW, ra->max_window);
+    __unlock(&(ra->lock));
+    return false;
+  }
+  const uint64_t nr = MIN(ra->window, ra_zone_remain(s, pa));
+  if ((nr < 2) || ra->filling) {
+    __unlock(&(ra->lock));
+    return false;
+  }
+
+  trace_selfie_readahead(s, pa, nr);
+  ra->filling = true;
+  ra->fill_pa = pa;
+  ra->fill_len = nr * bs;
+  ra->fill_valid = true; // cleared by writes completing while reading
+  __unlock(&(ra->lock));
+  const int rr = bdrv_pread(s->main, pa, ra->stage, nr * bs);
+  __lock(&(ra->lock));
+  ra->filling = false;
+  if ((rr != (nr * bs)) || (!ra->fill_valid)) {
+    __unlock(&(ra->lock));
+    return false;
+  }
+  uint8_t * const old = ra->buf;
+  ra->buf = ra->stage;
+  ra->stage = old;
+  ra->pa = pa;
+  ra->len = nr * bs;
+  ra->valid = true;
+  memcpy(buf, ra->buf, bs);
+  // the stream keeps going: grow the window
+  ra->window = MIN(ra->window * 2, ra->max_window);
+  __unlock(&(ra->lock));
+  return true;
+}
+
+  static void
+ra_init(struct SelfieState * const s, const uint64_t size)
+{
+  struct SelfieReadahead * const ra = &(s->ra);
+  qemu_co_mutex_init(&(ra->lock));
+  ra->max_window = size / s->block_size;
+  if (ra->max_window < 2) {
+    ra->max_window = 0;
+    return;
+  }
+  ra->window = MIN(RA_MIN_WINDOW, ra->max_window);
+  ra->last_pa = 0;
+  ra->valid = false;
+  ra->filling = false;
+  ra->buf = qemu_blockalign(s->main, ra->max_window * s->block_size);
+  ra->stage = qemu_blockalign(s->main, ra->max_window * s->block_size);
+}
+
+  static void
+ra_free(struct SelfieState * const s)
+{
+  qemu_vfree(s->ra.buf);
+  qemu_vfree(s->ra.stage);
+  s->ra.buf = NULL;
+  s->ra.stage = NULL;
+  s->ra.max_window = 0;
 }
 // }}}
 // {{{ read with zpage/mapping
@@ -548,70 +1523,143 @@ data_read_decode_z(struct SelfieState * const s, uint8_t * const buf)
   uint8_t zp[SELFIE_PAGE_SIZE] __attribute__ ((aligned(SELFIE_PAGE_SIZE)));
   struct SelfieZPage * const zpage = (typeof(zpage))zp;
   memcpy(zp, buf, SELFIE_PAGE_SIZE);
-  selfie_log_addr(s, "|--+>R_VA_DECODE_Z", zpage->zh.va, SELFIE_PAGE_SIZE);
   const bool rd = zpage_decode(s, buf, zpage);
   if (rd == false) {
     bzero(buf, s->block_size);
   }
 }
 
+  static bool
+data_read_check(struct SelfieState * const s, const uint64_t pa, const uint8_t * const buf)
+{
+  if (zone_pa_type(s, pa) == ZONE_TYPE_Z) {
+    return csum_z_check(s, buf, &(buf[SELFIE_PAGE_SIZE]));
+  }
+  return csum_n_check(s, pa, buf);
+}
+
+// a unit that fails its checksum unlocked may be between its data write and its
+// checksum update, which writers do under the index lock: read it again holding it.
+// after an unclean shutdown an in-place n-unit write may have reached the disk
+// without its checksum (or the reverse): the unit holds what the interrupted
+// write left, which an unflushed write allows, so its checksum is rebuilt.
+// z-units are never rewritten in place with checksums, they have nothing to repair
+// returns the pa read into buf (0 if va is no longer mapped to data), with *ok set
+  static uint64_t
+data_read_recheck(struct SelfieState * const s, const uint64_t va, uint8_t * const buf, bool * const ok)
+{
+  const uint64_t va_lock_id = (va >> s->header.block_shift) % I_LOCK_SCALE;
+  __lock(&(s->index_lock[va_lock_id]));
+  const uint64_t pa = index_translate(s, va);
+  *ok = true;
+  if (index_pa_data(pa)) {
+    const int rr = image_pread(s, pa, buf, s->block_size);
+    assert(rr == s->block_size);
+    *ok = data_read_check(s, pa, buf);
+    if ((!*ok) && s->csum_repair && (zone_pa_type(s, pa) == ZONE_TYPE_N)) {
+      trace_selfie_checksum_repair(s, va, pa);
+      csum_n_update(s, pa, buf);
+      atomic_inc(&(s->nr_csum_repairs));
+      *ok = true;
+    }
+  }
+  __unlock(&(s->index_lock[va_lock_id]));
+  return pa;
+}
+
 // read must success (assertion on illegal parameters)
 // transparently decode zpage
 // bzero on any exception
 // va always aligned to s->block_size
-  static void
+// returns false if the unit fails its checksum
+  static bool
 data_read_va(struct SelfieState * const s, const uint64_t va, uint8_t * const buf)
 {
-  selfie_log_addr(s, "|-->R_VA", va, s->block_size);
   // mapping va -> pa
   // check aligned va
   assert((va % s->block_size) == 0);
   assert(va < s->header.capacity);
-  const uint64_t pa = index_translate(s, va);
-  if (pa == 0) {
+  uint64_t pa = index_translate(s, va);
+  if (!index_pa_data(pa)) { // unmapped or zero
     bzero(buf, s->block_size);
-    return;
+    return true;
   }
   // read from pa
-  const int rr = image_pread(s, pa, buf, s->block_size);
-  assert(rr == s->block_size);
+  if (ra_read(s, pa, buf) == false) {
+    const int rr = image_pread(s, pa, buf, s->block_size);
+    assert(rr == s->block_size);
+  }
+  if (!data_read_check(s, pa, buf)) {
+    bool ok;
+    pa = data_read_recheck(s, va, buf, &ok);
+    if (!ok) {
+      trace_selfie_checksum_error(s, va, pa);
+      atomic_inc(&(s->nr_csum_errors));
+      return false;
+    }
+    if (!index_pa_data(pa)) { // zeroed meanwhile
+      bzero(buf, s->block_size);
+      return true;
+    }
+  }
   // if in z-zone, decompress the head page
   if (zone_pa_type(s, pa) == ZONE_TYPE_Z) {
     data_read_decode_z(s, buf);
   }
+  return true;
 }
 
 // }}}
 // {{{ write with zpage/mapping
-  static void
-data_write_alloc_z(struct SelfieState * const s, const uint64_t va, const struct SelfieZPage * const zpage)
+// a z-unit replacing an unmapped cluster is recovered by the open-time scan.
+// any other entry (SELFIE_PA_ZERO) would hide it from the scan: map it hard
+// the data write helpers below are called with index_lock held and unlock it,
+// they return -ENOSPC if no unit could be allocated.
+// data and checksum are written before the new mapping is published
+  static int
+data_write_alloc_z(struct SelfieState * const s, const uint64_t va,
+    const struct SelfieZPage * const zpage, const uint64_t cls, const uint64_t pa_old)
 {
-  const uint64_t pa = zone_alloc_z(s, va);
-  selfie_log_addr(s, "|--+>W_AL_Z_PA", pa, s->block_size);
-  assert(pa > 0);
-  index_map_soft(s, va, pa);
+  const uint64_t pa = zone_alloc_z(s, va, cls);
+  trace_selfie_alloc_z(s, va, pa);
+  if (pa == 0) {
+    __unlock(&(s->index_lock[(va >> s->header.block_shift) % I_LOCK_SCALE]));
+    return -ENOSPC;
+  }
   atomic_inc(&(s->nr_write_data_z));
   const int rw = image_pwrite(s, pa, zpage->buf, s->block_size);
   assert(rw == s->block_size);
+  if (pa_old) {
+    index_map_hard(s, va, pa);
+  } else {
+    index_map_soft(s, va, pa);
+  }
+  return 0;
 }
 
-  static void
-data_write_alloc_n(struct SelfieState * const s, const uint64_t va, const uint8_t * const buf)
+  static int
+data_write_alloc_n(struct SelfieState * const s, const uint64_t va,
+    const uint8_t * const buf, const uint64_t cls)
 {
-  const uint64_t pa = zone_alloc_n(s, va);
-  selfie_log_addr(s, "|--+>W_AL_N_PA", pa, s->block_size);
-  assert(pa > 0);
-  index_map_hard(s, va, pa);
+  const uint64_t pa = zone_alloc_n(s, va, cls);
+  trace_selfie_alloc_n(s, va, pa);
+  if (pa == 0) {
+    __unlock(&(s->index_lock[(va >> s->header.block_shift) % I_LOCK_SCALE]));
+    return -ENOSPC;
+  }
   atomic_inc(&(s->nr_write_data_n));
   const int rw = image_pwrite(s, pa, buf, s->block_size);
   assert(rw == s->block_size);
+  csum_n_update(s, pa, buf);
+  index_map_hard(s, va, pa);
+  return 0;
 }
 
-// do alloc and write aligned page
-  static void
-data_write_alloc(struct SelfieState * const s, const uint64_t va, const uint8_t * const buf)
+// do alloc and write aligned page, pa_old is the current entry of va
+  static int
+data_write_alloc(struct SelfieState * const s, const uint64_t va,
+    const uint8_t * const buf, const uint64_t cls, const uint64_t pa_old)
 {
-  selfie_log_addr(s, "|--->W_ALLOC", va, SELFIE_PAGE_SIZE);
   // try compress to z-zone
   assert((va % s->block_size) == 0);
   uint8_t zp[s->zbuffer_size] __attribute__ ((aligned(SELFIE_PAGE_SIZE)));
@@ -623,26 +1671,47 @@ data_write_alloc(struct SelfieState * const s, const uint64_t va, const uint8_t
     if (s->block_size > SELFIE_PAGE_SIZE) {
       memcpy(&(zp[SELFIE_PAGE_SIZE]), &(buf[SELFIE_PAGE_SIZE]), s->block_size - SELFIE_PAGE_SIZE);
     }
-    data_write_alloc_z(s, va, zpage);
+    csum_z_seal(s, zp, &(zp[SELFIE_PAGE_SIZE]));
+    return data_write_alloc_z(s, va, zpage, cls, pa_old);
   } else {
-    data_write_alloc_n(s, va, buf);
+    return data_write_alloc_n(s, va, buf, cls);
   }
 }
 
-// write aligned whole block (of s->block_size)
+// zeroes need no data unit: a cluster that was never written stays unmapped,
+// a mapped one is repointed to SELFIE_PA_ZERO and its unit released for reclaim
+// called with index_lock held, unlocks it
   static void
+data_write_zero(struct SelfieState * const s, const uint64_t va, const uint64_t pa)
+{
+  const uint64_t va_lock_id = (va >> s->header.block_shift) % I_LOCK_SCALE;
+  atomic_inc(&(s->nr_write_zero));
+  trace_selfie_write_zero(s, va, pa);
+  if (!index_pa_data(pa)) {
+    __unlock(&(s->index_lock[va_lock_id]));
+    return;
+  }
+  // unlocks index_lock
+  index_map_hard(s, va, SELFIE_PA_ZERO);
+}
+
+// write aligned whole block (of s->block_size)
+  static int
 data_write_va(struct SelfieState * const s, const uint64_t va, const uint8_t * const buf)
 {
-  selfie_log_addr(s, "|-->W_VA", va, s->block_size);
   assert((va % s->block_size) == 0);
   const uint64_t va_lock_id = (va >> s->header.block_shift) % I_LOCK_SCALE;
   // lock index
   __lock(&(s->index_lock[va_lock_id]));
+  const uint64_t cls = heat_class(heat_update(s, va));
   const uint64_t pa = index_translate(s, va);
-  if (pa == 0) { // need alloc
-    data_write_alloc(s, va, buf);
+  if (buffer_is_zero(buf, s->block_size)) {
+    data_write_zero(s, va, pa);
+    return 0;
+  }
+  if (!index_pa_data(pa)) { // need alloc
     // unlocked in data_write_alloc()
-    return;
+    return data_write_alloc(s, va, buf, cls, pa);
   }
   // va has mapping
   const uint32_t pa_type = zone_pa_type(s, pa);
@@ -651,10 +1720,16 @@ data_write_va(struct SelfieState * const s, const uint64_t va, const uint8_t * c
     bzero(zp, SELFIE_PAGE_SIZE);
     struct SelfieZPage * const zpage = (typeof(zpage))zp;
     const bool rz = zpage_encode(s, buf, zpage, va);
-    if (rz == true) { // can compress, write it
+    if ((rz == true) && csum_enabled(s)) { // a torn in-place write could not be told from corruption
+      if (s->block_size > SELFIE_PAGE_SIZE) {
+        memcpy(&(zp[SELFIE_PAGE_SIZE]), &(buf[SELFIE_PAGE_SIZE]), s->block_size - SELFIE_PAGE_SIZE);
+      }
+      csum_z_seal(s, zp, &(zp[SELFIE_PAGE_SIZE]));
+      return data_write_alloc_z(s, va, zpage, cls, pa);
+    } else if (rz == true) { // can compress, write it
       __unlock(&(s->index_lock[va_lock_id]));
       // write without metadata update
-      selfie_log_addr(s, "|-+>W_Z_PA", pa, s->block_size);
+      trace_selfie_write_inplace(s, va, pa, pa_type);
       atomic_inc(&(s->nr_write_data_z));
       const int rw1 = image_pwrite(s, pa, zpage->buf, SELFIE_PAGE_SIZE);
       assert(rw1 == SELFIE_PAGE_SIZE);
@@ -663,46 +1738,59 @@ data_write_va(struct SelfieState * const s, const uint64_t va, const uint8_t * c
         assert(rw2 == (s->block_size - SELFIE_PAGE_SIZE));
       }
     } else { // cannot compress, alloc n-zone space and write
-      // TODO: reclaim the lost z-zone space
-      data_write_alloc_n(s, va, buf);
+      const int ra = data_write_alloc_n(s, va, buf, cls);
+      if (ra < 0) return ra;
+      atomic_inc(&(s->nr_z_to_n));
     }
+  } else if ((pa_type == ZONE_TYPE_N) && (cls == STREAM_HOT) && (zone_pa_cls(s, pa) != STREAM_HOT)) {
+    // turned hot in a cold zone: move it to a hot stream, the old unit is released
+    return data_write_alloc_n(s, va, buf, cls);
   } else if (pa_type == ZONE_TYPE_N) { // n-zone, just write
-    __unlock(&(s->index_lock[va_lock_id]));
-    // write without metadata update
-    selfie_log_addr(s, "|-+>W_N_PA", pa, s->block_size);
+    const int rd = csum_mark_dirty(s, true);
+    if (rd < 0) {
+      __unlock(&(s->index_lock[va_lock_id]));
+      return rd;
+    }
+    // write without metadata update, readers recheck the checksum under index_lock
+    trace_selfie_write_inplace(s, va, pa, pa_type);
     atomic_inc(&(s->nr_write_data_n));
     const int rw = image_pwrite(s, pa, buf, s->block_size);
     assert(rw == s->block_size);
+    csum_n_update(s, pa, buf);
+    __unlock(&(s->index_lock[va_lock_id]));
   } else {
-    selfie_log_addr(s, "|-+>ERROR: write to O/L ZONE", pa, s->block_size);
     assert(false);
   }
+  return 0;
 }
 
-  static void
+// returns -EIO if the old content fails its checksum
+  static int
 data_write_va_partial(struct SelfieState * const s, const uint64_t va,
     const uint8_t * const buf, const uint64_t length)
 {
   //  (1) read the page if it exists.
-  selfie_log_addr(s, "|+>W_PART_VA", va, length);
+  trace_selfie_write_partial(s, va, length);
   const uint64_t shift = s->header.block_shift;
   const uint64_t va_aligned = (va >> shift) << shift;
   const uint64_t pg_off = va - va_aligned;
   assert((pg_off + length) <= s->block_size);
   uint8_t page[s->block_size] __attribute__((aligned (SELFIE_PAGE_SIZE)));
   const uint64_t pa = index_translate(s, va_aligned);
-  if (pa == 0) { // fastpath: alloc-write with no read
+  if (!index_pa_data(pa)) { // fastpath: alloc-write with no read
     bzero(page, s->block_size);
     memcpy(&(page[pg_off]), buf, length);
-    data_write_va(s, va_aligned, page);
-  } else if (pg_off < SELFIE_PAGE_SIZE) { // need to read anyway
-    data_read_va(s, va_aligned, page);
+    return data_write_va(s, va_aligned, page);
+  } else if ((pg_off < SELFIE_PAGE_SIZE) || csum_enabled(s)) { // need to read anyway
+    if (!data_read_va(s, va_aligned, page)) return -EIO;
     memcpy(&(page[pg_off]), buf, length);
-    data_write_va(s, va_aligned, page);
+    return data_write_va(s, va_aligned, page);
   } else { // write to pa with no read
+    heat_update(s, va_aligned);
     const int rw = image_pwrite(s, pa+pg_off, buf, length);
     assert(rw == length);
   }
+  return 0;
 }
 // }}}
 // {{{ selfie open
@@ -719,6 +1807,23 @@ selfie_open_init_locks(struct SelfieState * const s)
     qemu_co_mutex_init(&(s->index_lock[x]));
   }
   qemu_co_mutex_init(&(s->zone_lock));
+  qemu_co_rwlock_init(&(s->reloc_lock));
+  qemu_co_mutex_init(&(s->csum_lock));
+  uint64_t c;
+  for (c = 0; c < SELFIE_NR_CLASSES; c++) {
+    for (x = 0; x < SELFIE_MAX_STREAMS; x++) {
+      qemu_co_mutex_init(&(s->zstreams[c][x].lock));
+      s->zstreams[c][x].id_zone = SELFIE_NO_ZONE;
+      s->zstreams[c][x].cls = c;
+      qemu_co_mutex_init(&(s->nstreams[c][x].lock));
+      s->nstreams[c][x].id_zone = SELFIE_NO_ZONE;
+      s->nstreams[c][x].cls = c;
+    }
+  }
+  qemu_co_mutex_init(&(s->lstream.lock));
+  s->lstream.id_zone = SELFIE_NO_ZONE;
+  s->lstream.cls = STREAM_COLD;
+  qemu_co_mutex_init(&(s->cbatch.lock));
 }
 
 // load all zone metadata from the image
@@ -729,108 +1834,114 @@ selfie_open_load_zones(struct SelfieState * const s)
   const int zi_size = sizeof(s->zones[0]) * nr_zones;
   s->zones = g_malloc0(zi_size);
   assert(s->zones != NULL);
-  selfie_log_addr(s, "*ZONE_LOAD_ALL",s->header.pa_zi, zi_size);
-  const int rz = bdrv_pread(s->main, s->header.pa_zi, s->zones, zi_size);
+  const int rz = bdrv_pread(image_file(s, s->header.pa_zi), s->header.pa_zi, s->zones, zi_size);
   assert(rz == zi_size);
-  int i;
+  uint64_t nr[4] = {0, 0, 0, 0};
+  uint64_t i;
   for (i = 0; i < nr_zones; i++) {
-    switch (s->zones[i].t) {
-      case ZONE_TYPE_Z: selfie_log(s, "LOAD ZONE[%4d]:Z", i); break;
-      case ZONE_TYPE_N: selfie_log(s, "LOAD ZONE[%4d]:N", i); break;
-      case ZONE_TYPE_L: selfie_log(s, "LOAD ZONE[%4d]:L", i); break;
-      default: break;
-    }
+    nr[s->zones[i].t]++;
+    s->nr_zones_of[s->zones[i].t]++;
+    s->nr_units_of[s->zones[i].t] += s->zones[i].n;
   }
+  s->nr_zones_free = nr[ZONE_TYPE_0];
+  trace_selfie_open_zones(s, nr[ZONE_TYPE_Z], nr[ZONE_TYPE_N], nr[ZONE_TYPE_L]);
 }
 
-// initialize id_lzone
+// a partially used zone no stream took (opened with more streams before):
+// streams adopt it before claiming unused zones, see zone_adopt()
   static void
-selfie_open_lzones(struct SelfieState * const s)
+selfie_open_orphan(struct SelfieState * const s, const uint64_t id)
 {
-  // scan for empty n-zone
-  const uint64_t nr_zones = s->header.nr_zones;
-  s->id_lzone = nr_zones + 10;
-  uint64_t i;
-  for (i = 0; i < nr_zones; i++) {
-    if (s->zones[i].t == ZONE_TYPE_0) { // unused zone. alloc new zone
-      s->id_lzone = i;
-      const bool rn = zone_alloc_type(s, ZONE_TYPE_L);
-      assert(rn);
-      break;
-    }
-    if ((s->zones[i].t == ZONE_TYPE_L) && (s->zones[i].n < s->nr_zone_page)) {
-      s->id_lzone = i;
-      break;
-    }
+  s->orphans = g_renew(uint64_t, s->orphans, s->nr_orphans + 1);
+  s->orphans[s->nr_orphans++] = id;
+}
+
+// give a partially used zone to the next stream of its class without one
+// next[] counts the streams of each class that have a zone
+  static void
+selfie_open_attach(struct SelfieState * const s, struct SelfieStream (* const streams)[SELFIE_MAX_STREAMS],
+    uint64_t * const next, const uint64_t id)
+{
+  const uint64_t cls = s->zones[id].c;
+  if (next[cls] < zone_class_streams(s, cls)) {
+    streams[cls][next[cls]++].id_zone = id;
+  } else {
+    selfie_open_orphan(s, id);
   }
-  assert(s->id_lzone < nr_zones);
 }
 
-// initialize id_nzone
+// attach partially used zones to the streams, the rest are opened on demand
+// reclaimed zones leave holes: allocation restarts at the first unused one
   static void
-selfie_open_nzones(struct SelfieState * const s)
+selfie_open_streams(struct SelfieState * const s)
 {
-  // scan for empty n-zone
   const uint64_t nr_zones = s->header.nr_zones;
-  s->id_nzone = nr_zones + 10;
+  uint64_t nz[SELFIE_NR_CLASSES] = {0, 0, 0};
+  uint64_t nn[SELFIE_NR_CLASSES] = {0, 0, 0};
+  s->id_free = nr_zones;
   uint64_t i;
   for (i = 0; i < nr_zones; i++) {
-    if (s->zones[i].t == ZONE_TYPE_0) { // unused zone. alloc new zone
-      s->id_nzone = i;
-      const bool rn = zone_alloc_type(s, ZONE_TYPE_N);
-      assert(rn);
-      break;
+    const struct SelfieZoneInfo * const zi = &(s->zones[i]);
+    if (zi->t == ZONE_TYPE_0) {
+      s->id_free = MIN(s->id_free, i);
+      continue;
     }
-    if ((s->zones[i].t == ZONE_TYPE_N) && (s->zones[i].n < s->nr_zone_unit)) {
-      s->id_nzone = i;
-      break;
+    if ((zi->t == ZONE_TYPE_Z) && (zi->n < s->nr_zone_unit)) {
+      selfie_open_attach(s, s->zstreams, nz, i);
+    } else if ((zi->t == ZONE_TYPE_N) && (zi->n < s->nr_zone_unit_n)) {
+      selfie_open_attach(s, s->nstreams, nn, i);
+    } else if ((zi->t == ZONE_TYPE_L) && (zi->n < s->nr_zone_page)) {
+      if (s->lstream.id_zone == SELFIE_NO_ZONE) {
+        s->lstream.id_zone = i;
+      } else {
+        selfie_open_orphan(s, i);
+      }
     }
   }
-  assert(s->id_nzone < nr_zones);
 }
 
   static void
 selfie_open_load_l2(struct SelfieState * const s, struct SelfieIndexL1 * const node, const uint64_t j)
 {
-  const uint64_t next_pa_n = zone_id_to_pa(s, s->id_nzone, s->zones[s->id_nzone].n);
   const uint64_t pa_l2 = node->l1_page[j];
   // read valid l2
   node->l2_pages[j] = aligned_alloc(SELFIE_PAGE_SIZE, SELFIE_PAGE_SIZE);
   assert(node->l2_pages[j]);
+  s->nr_index_pages++;
   assert(zone_pa_type(s, pa_l2) == ZONE_TYPE_L);
-  const ssize_t r2 = bdrv_pread(s->main, pa_l2, node->l2_pages[j], SELFIE_PAGE_SIZE);
+  const ssize_t r2 = bdrv_pread(image_file(s, pa_l2), pa_l2, node->l2_pages[j], SELFIE_PAGE_SIZE);
   assert(r2 == SELFIE_PAGE_SIZE);
-  uint64_t * const l2_page = node->l2_pages[j];
-  uint64_t k;
-  for (k = 0; k < 512; k++) {
-    const uint64_t pa_data = l2_page[k];
-    if (pa_data && (zone_pa_type(s, pa_data) == ZONE_TYPE_N) && (pa_data >= next_pa_n)) {
-      l2_page[k] = 0; // invalid pa_data
-    }
-  }
+  // invalid pa_data
+  index_l2_sanitize(s, s->zones, node->l2_pages[j], false);
 }
 
   static void
 selfie_open_load_l1(struct SelfieState * const s, const uint64_t i)
 {
   struct SelfieIndexL1 * const node = &(s->nodes[i]);
-  const uint64_t next_pa_l2 = zone_id_to_pa(s, s->id_lzone, s->zones[s->id_lzone].n);
+  const uint64_t pa_l1 = s->header.pa_l1 + (i * SELFIE_PAGE_SIZE);
+  if (s->imap) { // entries are checked on first use
+    node->l1_page = (uint64_t *)(s->imap + pa_l1);
+    node->mapped1 = true;
+    return;
+  }
   // load l1
   node->l1_page = aligned_alloc(SELFIE_PAGE_SIZE, SELFIE_PAGE_SIZE);
   assert(node->l1_page);
-  const uint64_t pa_l1 = s->header.pa_l1 + (i * SELFIE_PAGE_SIZE);
-  const ssize_t r1 = bdrv_pread(s->main, pa_l1, node->l1_page, SELFIE_PAGE_SIZE);
+  s->nr_index_pages++;
+  const ssize_t r1 = bdrv_pread(image_file(s, pa_l1), pa_l1, node->l1_page, SELFIE_PAGE_SIZE);
   assert(r1 == SELFIE_PAGE_SIZE);
   uint64_t j;
   // load l2
   for (j = 0; j < 512; j++) {
+    node->checked[j] = true;
     const uint64_t pa_l2 = node->l1_page[j];
     if (pa_l2 == 0) continue;
 
-    if (pa_l2 >= next_pa_l2) {
-      // invalid pa_l2
+    if (!index_l1_entry_valid(s, s->zones, pa_l2)) {
+      // invalid pa_l2 or extent
       node->l1_page[j] = 0;
-    } else { // pa_l2 is valid
+    } else if ((pa_l2 & L1_EXTENT) == 0) { // pa_l2 is valid, extents have nothing to load
       selfie_open_load_l2(s, node, j);
     }
   }
@@ -858,7 +1969,7 @@ selfie_open_load_index(struct SelfieState * const s)
 open_scan_zzone(struct SelfieState * const s, const uint64_t id)
 {
   assert(s->zones[id].n == 0); // scan a 0 z-zone
-  selfie_log(s, "scanning z [%"PRIu64"]", id);
+  trace_selfie_scan_zone(s, id);
   uint8_t buf[s->block_size] __attribute__((aligned(SELFIE_PAGE_SIZE)));
   uint8_t zp[s->block_size] __attribute__((aligned(SELFIE_PAGE_SIZE)));
   struct SelfieZPage * const zpage = (typeof(zpage))zp;
@@ -869,53 +1980,48 @@ open_scan_zzone(struct SelfieState * const s, const uint64_t id)
     const uint64_t pa = zone_id_to_pa(s, id, i);
     const int rr = bdrv_pread(s->main, pa, zpage->buf, s->block_size);
     assert(rr == s->block_size);
+    // a torn or stale unit ends the zone
+    if (!csum_z_check(s, zpage->buf, &(zpage->buf[SELFIE_PAGE_SIZE]))) {
+      break;
+    }
     // check
     const bool rd = zpage_decode(s, buf, zpage);
     if (rd == true) {
       s->zones[id].n++;
+      s->nr_units_of[ZONE_TYPE_Z]++;
       const uint64_t npa = index_translate(s, zpage->zh.va);
       if (npa == 0) {
         const uint64_t va_lock_id = (zpage->zh.va >> s->header.block_shift) % I_LOCK_SCALE;
         __lock(&(s->index_lock[va_lock_id]));
         index_map_soft(s, zpage->zh.va, pa);
-        selfie_log_addr(s, "found zpage", zpage->zh.va, SELFIE_PAGE_SIZE);
+        trace_selfie_scan_found(s, zpage->zh.va, pa);
       } else {
-        // If map exists, the z-page has been replaced by a n-page, or has been written.
-        assert((zone_pa_type(s, npa) == ZONE_TYPE_N) || (npa == pa));
+        // If map exists, the z-page has been replaced by a n-page, has been written,
+        // has been relocated to another z-zone by defrag, or has been zeroed.
+        assert((npa == SELFIE_PA_ZERO) || (zone_pa_type(s, npa) == ZONE_TYPE_N) ||
+            (zone_pa_type(s, npa) == ZONE_TYPE_Z));
         // if it's a n-page the zpage is be invalid and the space should be reclaimed.
         // TODO: reclaim leaked z-zone space
+        if (npa != pa) s->nr_leaked_scan++;
       }
     } else {
       // no more z-page, finish.
       break;
     }
   }
-  selfie_log(s, "scanned, found %"PRIu64" pages, max %"PRIu64, s->zones[id].n, s->nr_zone_unit);
+  trace_selfie_scan_zone_done(s, id, s->zones[id].n, s->nr_zone_unit);
 }
 
   static void
 selfie_open_scan_zzones(struct SelfieState * const s)
 {
   const uint64_t nr_zones = s->header.nr_zones;
-  s->id_zzone = nr_zones + 10; // invalid id
-  // scan for last z-zone
+  // every stream may have left a half-used z-zone: scan them all
   uint64_t i;
   for (i = 0; i < nr_zones; i++) {
-    if (s->zones[i].t == ZONE_TYPE_0) { // unused zone. mark as a z-zone
-      s->id_zzone = i;
-      const bool rz = zone_alloc_type(s, ZONE_TYPE_Z);
-      assert(rz);
-      // no more scan
-      break;
-    }
     if (s->zones[i].t == ZONE_TYPE_Z) { // zzone
       if (s->zones[i].n == 0) { // mapping not synced
-        s->id_zzone = i;
         open_scan_zzone(s, i);
-        if (s->zones[i].n != s->nr_zone_unit) {
-          // found an half-used zzone
-          break;
-        }
       } else {
         // a z-zone must be either 0 or full
         assert(s->zones[i].n == s->nr_zone_unit);
@@ -923,75 +2029,396 @@ selfie_open_scan_zzones(struct SelfieState * const s)
       }
     }
   }
-  assert(s->id_zzone < nr_zones);
 }
 
-  static int
-selfie_open(BlockDriverState * const bs, QDict *options, int flags, Error **errp)
+// true if options carry a reference to, or options for, the metadata file
+  static bool
+selfie_open_meta_in_options(QDict * const options)
 {
-  struct SelfieState * const s = bs->opaque;
-  bzero(s, sizeof(*s));
-  // read header
-  const int rh = bdrv_pread(bs->file, 0, &(s->header), sizeof(s->header));
-  assert(rh == sizeof(s->header));
-  // for debug
-  s->fd_log = open("/tmp/selfie-debug.log", O_CREAT | O_APPEND | O_WRONLY | O_DSYNC, 00644);
-  selfie_log(s, "capacity: %"PRIu64, s->header.capacity);
-  selfie_log(s, "shift: %"PRIu64, s->header.block_shift);
-  selfie_log(s, "nr_l1: %"PRIu64, s->header.nr_l1);
-  selfie_log(s, "zone_size: %"PRIu64, s->header.zone_size);
-  selfie_log(s, "nr_zones: %"PRIu64, s->header.nr_zones);
-  selfie_log(s, "pa_zi: %"PRIu64, s->header.pa_zi);
-  selfie_log(s, "pa_l1: %"PRIu64, s->header.pa_l1);
-  selfie_log(s, "pa_zones: %"PRIu64, s->header.pa_zones);
-  selfie_log(s, "init_type: %"PRIu64, s->header.init_type);
-  s->main = bs->file;
-  // setup bs
-  s->block_size = 1 << s->header.block_shift;
-  s->zdata_size = SELFIE_PAGE_SIZE - sizeof(struct SelfiePageHead);
-  const uint64_t bound = LZ4_compressBound(s->block_size);
-  s->zbuffer_size = s->block_size;
-  while (s->zbuffer_size < bound) s->zbuffer_size += SELFIE_PAGE_SIZE;
-  s->nr_zone_unit = s->header.zone_size / s->block_size;
-  s->nr_zone_page = s->header.zone_size / SELFIE_PAGE_SIZE;
-  bs->total_sectors = s->header.capacity / 512;
-  // load zone metadata
-  selfie_open_init_locks(s);
-  selfie_open_load_zones(s);
-  selfie_open_lzones(s);
-  selfie_open_nzones(s);
-  selfie_open_load_index(s);
-  selfie_open_scan_zzones(s);
-  index_mapping_print(s, "OPEN");
-  return 0;
+  const QDictEntry * e;
+  for (e = qdict_first(options); e; e = qdict_next(options, e)) {
+    if (strstart(qdict_entry_key(e), "metadata-file", NULL)) return true;
+  }
+  return false;
 }
 
-// }}}
-// {{{ selfie_read API
+// open the metadata file named in the header, or given by the "metadata-file" option
   static int
-selfie_read(struct SelfieState * const s, const uint64_t sector_num,
-    uint8_t * const buf, const uint64_t nb_sectors)
+selfie_open_meta(BlockDriverState * const bs, QDict * const options, const int flags, Error **errp)
 {
-  // LOG
-  selfie_log_addr(s, "|->SELFIE_READ", sector_num * 512, nb_sectors * 512);
-  if (nb_sectors == 0) return 0;
-
-  uint64_t i;
-  uint8_t page[s->block_size] __attribute__((aligned (SELFIE_PAGE_SIZE)));
-  const uint64_t shift = s->header.block_shift;
-  uint64_t cur_pva = (sector_num * 512) >> shift << shift;
-  // read first block
-  data_read_va(s, cur_pva, page);
-  for (i = 0; i < nb_sectors; i++) {
-    const uint64_t sva = ((sector_num + i) * 512) >> shift << shift;
-    if (sva != cur_pva) {
-      // read
-      data_read_va(s, sva, page);
-      cur_pva = sva;
-    }
-    const uint64_t poff = ((sector_num + i) * 512) % s->block_size;
-    const uint64_t boff = i * 512;
-    memcpy(&(buf[boff]), &(page[poff]), 512);
+  struct SelfieState * const s = bs->opaque;
+  char * filename = NULL;
+  if (selfie_open_meta_in_options(options) == false) {
+    char meta_file[SELFIE_META_PATH_SIZE];
+    pstrcpy(meta_file, sizeof(meta_file), s->header.meta_file);
+    filename = g_malloc(PATH_MAX);
+    path_combine(filename, PATH_MAX, bs->file->filename, meta_file);
+  }
+  Error *local_err = NULL;
+  const int ro = bdrv_open_image(&(s->meta), filename, options, "metadata-file",
+      flags | BDRV_O_PROTOCOL, false, &local_err);
+  g_free(filename);
+  if (ro < 0) {
+    error_propagate(errp, local_err);
+    return ro;
+  }
+  return 0;
+}
+
+static QemuOptsList selfie_runtime_opts = {
+  .name = "selfie",
+  .head = QTAILQ_HEAD_INITIALIZER(selfie_runtime_opts.head),
+  .desc = {
+    {
+      .name = "readahead",
+      .type = QEMU_OPT_SIZE,
+      .help = "Maximum sequential readahead window (default 256KB, 0 disables)",
+    },
+    {
+      .name = "mmap-index",
+      .type = QEMU_OPT_BOOL,
+      .help = "Map the index from the host file instead of loading it (default off)",
+    },
+    {
+      .name = "streams",
+      .type = QEMU_OPT_NUMBER,
+      .help = "Open zones per data type for concurrent allocation (1-16, default 4)",
+    },
+    { /* end of list */ }
+  }
+};
+
+// count the mapped units of every data zone, zones with none are freed on the first flush
+// skipped with mmap-index: it would fault in the whole index
+  static void
+selfie_open_count_live(struct SelfieState * const s)
+{
+  if (s->imap) return;
+  s->zone_live = g_new0(uint32_t, s->header.nr_zones);
+  uint64_t i, j, k;
+  for (i = 0; i < s->header.nr_l1; i++) {
+    const struct SelfieIndexL1 * const node = &(s->nodes[i]);
+    for (j = 0; j < 512; j++) {
+      if (node->l1_page[j] & L1_EXTENT) {
+        const uint64_t base = node->l1_page[j] & ~L1_EXTENT;
+        s->zone_live[(base - s->header.pa_zones) / s->header.zone_size] += 512;
+      } else if (node->l2_pages[j]) {
+        for (k = 0; k < 512; k++) {
+          const uint64_t pa = node->l2_pages[j][k];
+          if (index_pa_data(pa)) {
+            s->zone_live[(pa - s->header.pa_zones) / s->header.zone_size]++;
+          }
+        }
+      }
+    }
+  }
+  s->reclaim_pending = true;
+}
+
+// load the index and recover the z-zones; locks are taken as in normal i/o
+  static void coroutine_fn
+selfie_co_open_index(struct SelfieState * const s, void * const opaque)
+{
+  selfie_open_load_index(s);
+  selfie_open_scan_zzones(s);
+  selfie_open_streams(s);
+  selfie_open_count_live(s);
+}
+
+  static int
+selfie_open(BlockDriverState * const bs, QDict *options, int flags, Error **errp)
+{
+  struct SelfieState * const s = bs->opaque;
+  bzero(s, sizeof(*s));
+  Error *local_err = NULL;
+  QemuOpts * const opts = qemu_opts_create(&selfie_runtime_opts, NULL, 0, &error_abort);
+  qemu_opts_absorb_qdict(opts, options, &local_err);
+  if (local_err) {
+    error_propagate(errp, local_err);
+    qemu_opts_del(opts);
+    return -EINVAL;
+  }
+  const uint64_t ra_size = qemu_opt_get_size(opts, "readahead", RA_DEFAULT_SIZE);
+  s->nr_streams = qemu_opt_get_number(opts, "streams", SELFIE_DEFAULT_STREAMS);
+  const bool mmap_index = qemu_opt_get_bool(opts, "mmap-index", false);
+  qemu_opts_del(opts);
+  if ((s->nr_streams == 0) || (s->nr_streams > SELFIE_MAX_STREAMS)) {
+    error_setg(errp, "streams must be between 1 and %d", SELFIE_MAX_STREAMS);
+    return -EINVAL;
+  }
+  // read header
+  const int rh = bdrv_pread(bs->file, 0, &(s->header), sizeof(s->header));
+  assert(rh == sizeof(s->header));
+  trace_selfie_open(s, s->header.capacity, s->header.block_shift, s->header.zone_size,
+      s->header.nr_zones, s->header.init_type);
+  trace_selfie_open_layout(s, s->header.nr_l1, s->header.pa_zi, s->header.pa_l1, s->header.pa_zones);
+  s->main = bs->file;
+  if (s->header.flags & SELFIE_F_META_FILE) {
+    const int rm = selfie_open_meta(bs, options, flags, errp);
+    if (rm < 0) return rm;
+  }
+  // setup bs
+  s->block_size = 1 << s->header.block_shift;
+  s->zdata_size = SELFIE_PAGE_SIZE - sizeof(struct SelfiePageHead);
+  if (csum_enabled(s)) {
+    s->zdata_size -= sizeof(uint32_t); // checksum slot
+    s->csum_repair = (s->header.flags & SELFIE_F_DIRTY) != 0; // not closed cleanly
+  }
+  const uint64_t bound = LZ4_compressBound(s->block_size);
+  s->zbuffer_size = s->block_size;
+  while (s->zbuffer_size < bound) s->zbuffer_size += SELFIE_PAGE_SIZE;
+  s->nr_zone_unit = s->header.zone_size / s->block_size;
+  s->nr_zone_page = s->header.zone_size / SELFIE_PAGE_SIZE;
+  s->nr_zone_unit_n = s->nr_zone_unit;
+  if (csum_enabled(s)) {
+    s->nr_zone_unit_n -= csum_table_units(s);
+    s->ncsum = g_new0(uint32_t *, s->header.nr_zones);
+  }
+  bs->total_sectors = s->header.capacity / 512;
+  // load zone metadata
+  selfie_open_init_locks(s);
+  ra_init(s, ra_size);
+  selfie_open_load_zones(s);
+  if (mmap_index) {
+    const int rm = index_map_file(s, errp);
+    if (rm < 0) {
+      free(s->zones);
+      g_free(s->orphans);
+      ra_free(s);
+      if (s->meta) bdrv_unref(s->meta);
+      return rm;
+    }
+  }
+  selfie_co_call(s, bs, selfie_co_open_index, NULL);
+  index_mapping_print(s, "OPEN");
+  return 0;
+}
+
+// }}}
+// {{{ compressed write batch
+// units of a batch are encoded on the thread pool, then allocated and
+// written in runs of consecutive units; the mappings are only kept in
+// memory until the end of the conversion (see cbatch_sync())
+
+  static int
+cbatch_init(struct SelfieState * const s)
+{
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  if (cb->cap) return 0;
+  const uint64_t cap = MAX(CBATCH_SIZE / s->block_size, 1);
+  const uint64_t size = cap * s->block_size;
+  cb->raw = qemu_try_blockalign(s->main, size);
+  cb->enc = qemu_try_blockalign(s->main, size);
+  cb->run = qemu_try_blockalign(s->main, size);
+  if ((cb->raw == NULL) || (cb->enc == NULL) || (cb->run == NULL)) {
+    qemu_vfree(cb->raw);
+    qemu_vfree(cb->enc);
+    qemu_vfree(cb->run);
+    return -ENOMEM;
+  }
+  cb->va = g_new(uint64_t, cap);
+  cb->z = g_new(bool, cap);
+  cb->cap = cap;
+  cb->nr = 0;
+  return 0;
+}
+
+  static void
+cbatch_free(struct SelfieState * const s)
+{
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  if (cb->cap == 0) return;
+  qemu_vfree(cb->raw);
+  qemu_vfree(cb->enc);
+  qemu_vfree(cb->run);
+  g_free(cb->va);
+  g_free(cb->z);
+  bzero(cb, sizeof(*cb));
+}
+
+struct SelfieCBatchJob {
+  struct SelfieState * s;
+  uint64_t first;
+  uint64_t nr;
+};
+
+// thread pool worker: encode clusters [first, first + nr) of the batch
+  static int
+cbatch_encode(void * const opaque)
+{
+  const struct SelfieCBatchJob * const job = opaque;
+  struct SelfieState * const s = job->s;
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  uint64_t i;
+  for (i = job->first; i < (job->first + job->nr); i++) {
+    const uint8_t * const raw = &(cb->raw[i * s->block_size]);
+    uint8_t * const enc = &(cb->enc[i * s->block_size]);
+    struct SelfieZPage * const zpage = (typeof(zpage))enc;
+    bzero(enc, SELFIE_PAGE_SIZE);
+    cb->z[i] = zpage_encode(s, raw, zpage, cb->va[i]);
+    if (cb->z[i] && (s->block_size > SELFIE_PAGE_SIZE)) {
+      memcpy(&(enc[SELFIE_PAGE_SIZE]), &(raw[SELFIE_PAGE_SIZE]), s->block_size - SELFIE_PAGE_SIZE);
+    }
+    if (cb->z[i]) {
+      csum_z_seal(s, enc, &(enc[SELFIE_PAGE_SIZE]));
+    }
+  }
+  return 0;
+}
+
+  static void
+cbatch_encode_cb(void * const opaque, const int ret)
+{
+  struct SelfieState * const s = opaque;
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  assert(ret == 0);
+  cb->pending--;
+  if ((cb->pending == 0) && cb->waiter) {
+    qemu_coroutine_enter(cb->waiter, NULL);
+  }
+}
+
+// encode all buffered clusters in parallel on the thread pool
+  static void coroutine_fn
+cbatch_encode_all(struct SelfieState * const s)
+{
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  AioContext * const ctx = bdrv_get_aio_context(s->main);
+  ThreadPool * const pool = aio_get_thread_pool(ctx);
+  struct SelfieCBatchJob jobs[CBATCH_WORKERS];
+  const uint64_t per_job = DIV_ROUND_UP(cb->nr, CBATCH_WORKERS);
+  uint64_t i;
+  for (i = 0; (i * per_job) < cb->nr; i++) {
+    jobs[i].s = s;
+    jobs[i].first = i * per_job;
+    jobs[i].nr = MIN(per_job, cb->nr - jobs[i].first);
+    cb->pending++;
+    thread_pool_submit_aio(pool, cbatch_encode, &(jobs[i]), cbatch_encode_cb, s);
+  }
+  if (cb->pending) {
+    cb->waiter = qemu_coroutine_self();
+    qemu_coroutine_yield();
+    cb->waiter = NULL;
+  }
+}
+
+// allocate and write the clusters of the batch that were (not) compressed
+// returns -ENOSPC if the image ran out of space, the clusters written so far stay mapped
+  static int
+cbatch_write_type(struct SelfieState * const s, const bool z)
+{
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  const uint8_t * const src = z ? cb->enc : cb->raw;
+  uint64_t * const idx = g_new(uint64_t, cb->nr);
+  uint64_t want = 0;
+  uint64_t i;
+  for (i = 0; i < cb->nr; i++) {
+    if (cb->z[i] == z) want++;
+  }
+  i = 0;
+  while (want) {
+    while (cb->z[i] != z) i++;
+    uint64_t got = 0;
+    const uint64_t pa = zone_alloc_data(s, z ? ZONE_TYPE_Z : ZONE_TYPE_N, cb->va[i], STREAM_COLD, want, &got);
+    if (pa == 0) {
+      g_free(idx);
+      return -ENOSPC;
+    }
+    uint64_t n = 0;
+    for (; n < got; i++) {
+      if (cb->z[i] != z) continue;
+      memcpy(&(cb->run[n * s->block_size]), &(src[i * s->block_size]), s->block_size);
+      idx[n++] = i;
+    }
+    const int rw = image_pwrite(s, pa, cb->run, got * s->block_size);
+    assert(rw == (got * s->block_size));
+    for (n = 0; n < got; n++) {
+      const uint64_t va = cb->va[idx[n]];
+      const uint64_t pa_unit = pa + (n * s->block_size);
+      const uint64_t va_lock_id = (va >> s->header.block_shift) % I_LOCK_SCALE;
+      if (z) {
+        trace_selfie_alloc_z(s, va, pa_unit);
+        atomic_inc(&(s->nr_write_data_z));
+      } else {
+        trace_selfie_alloc_n(s, va, pa_unit);
+        atomic_inc(&(s->nr_write_data_n));
+        csum_n_update(s, pa_unit, &(cb->run[n * s->block_size]));
+      }
+      __lock(&(s->index_lock[va_lock_id]));
+      index_map_soft(s, va, pa_unit);
+    }
+    want -= got;
+  }
+  g_free(idx);
+  return 0;
+}
+
+// encode and write all buffered clusters, called with cb->lock held
+// on error the clusters that got no unit are dropped
+  static int coroutine_fn
+cbatch_flush_locked(struct SelfieState * const s)
+{
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  int ret = 0;
+  if (cb->nr) { // not flushed while waiting
+    cbatch_encode_all(s);
+    ret = cbatch_write_type(s, true);
+    if (ret == 0) {
+      ret = cbatch_write_type(s, false);
+    }
+    cb->nr = 0;
+    cb->unsynced = true;
+  }
+  return ret;
+}
+
+  static int coroutine_fn
+cbatch_flush(struct SelfieState * const s)
+{
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  if (cb->nr == 0) return 0;
+  __lock(&(cb->lock));
+  const int ret = cbatch_flush_locked(s);
+  __unlock(&(cb->lock));
+  return ret;
+}
+
+// flush the batch and write the index once for all of it
+// n-unit counters were synced on allocation, so l2 can refer to them now
+  static int coroutine_fn
+cbatch_sync(struct SelfieState * const s)
+{
+  const int ret = cbatch_flush(s);
+  if (s->cbatch.unsynced) {
+    index_flush(s);
+    s->cbatch.unsynced = false;
+  }
+  return ret;
+}
+// }}}
+// {{{ selfie_read API
+  static int
+selfie_read(struct SelfieState * const s, const uint64_t sector_num,
+    uint8_t * const buf, const uint64_t nb_sectors)
+{
+  if (nb_sectors == 0) return 0;
+
+  uint64_t i;
+  uint8_t page[s->block_size] __attribute__((aligned (SELFIE_PAGE_SIZE)));
+  const uint64_t shift = s->header.block_shift;
+  uint64_t cur_pva = (sector_num * 512) >> shift << shift;
+  // read first block
+  if (!data_read_va(s, cur_pva, page)) return -EIO;
+  for (i = 0; i < nb_sectors; i++) {
+    const uint64_t sva = ((sector_num + i) * 512) >> shift << shift;
+    if (sva != cur_pva) {
+      // read
+      if (!data_read_va(s, sva, page)) return -EIO;
+      cur_pva = sva;
+    }
+    const uint64_t poff = ((sector_num + i) * 512) % s->block_size;
+    const uint64_t boff = i * 512;
+    memcpy(&(buf[boff]), &(page[poff]), 512);
   }
   return 0;
 }
@@ -1002,15 +2429,19 @@ selfie_co_read(BlockDriverState * const bs, const int64_t sector_num,
 {
   struct SelfieState * const s = bs->opaque;
   assert((nb_sectors*512) == qiov->size);
+  trace_selfie_co_readv(s, sector_num, nb_sectors);
   if ((sector_num + nb_sectors) * 512 > s->header.capacity) {
-    selfie_log(s, "ERROR: read beyond capacity");
     return -EINVAL;
   }
+  // buffered compressed writes are not mapped yet
+  const int rf = cbatch_flush(s);
+  if (rf < 0) return rf;
   int i;
   int64_t sec_iter = sector_num;
   for (i = 0; i < qiov->niov; i++) {
     const size_t nr_sec = qiov->iov[i].iov_len>>9;
-    selfie_read(s, sec_iter, qiov->iov[i].iov_base, nr_sec);
+    const int rr = selfie_read(s, sec_iter, qiov->iov[i].iov_base, nr_sec);
+    if (rr < 0) return rr;
     sec_iter += nr_sec;
   }
   return 0;
@@ -1025,19 +2456,16 @@ selfie_write(struct SelfieState * const s, const int64_t sector_num,
   const uint64_t off_start = sector_num * UINT64_C(512);
   const uint64_t off_end = (sector_num + nb_sectors) * UINT64_C(512);
   uint64_t va_page;
-  // LOG
   const uint64_t shift = s->header.block_shift;
-  selfie_log_addr(s, "|->SELFIE_WRITE", off_start, off_end - off_start);
   for (va_page = ((off_start >> shift) << shift); va_page < off_end; va_page += s->block_size) {
     const uint64_t va0 = (va_page < off_start) ? off_start : va_page;
     const uint64_t va1 = ((va_page + s->block_size) < off_end) ? (va_page + s->block_size) : off_end;
     const uint64_t offset = va0 - off_start;
     const uint64_t length = va1 - va0;
-    if (length < s->block_size) { // what ever
-      data_write_va_partial(s, va0, &(buf[offset]), length);
-    } else { // whole block write
-      data_write_va(s, va0, &(buf[offset]));
-    }
+    const int rw = (length < s->block_size) ? // what ever
+      data_write_va_partial(s, va0, &(buf[offset]), length) :
+      data_write_va(s, va0, &(buf[offset])); // whole block write
+    if (rw < 0) return rw;
   }
   return 0;
 }
@@ -1050,28 +2478,365 @@ selfie_co_write(BlockDriverState * const bs, const int64_t sector_num,
     return -EACCES;
   struct SelfieState * const s = bs->opaque;
   assert((nb_sectors * 512) == qiov->size);
+  trace_selfie_co_writev(s, sector_num, nb_sectors);
   if ((sector_num + nb_sectors) * 512 > s->header.capacity) {
-    selfie_log(s, "fatal error@selfie_co_write(): write after END");
     return -EINVAL;
   }
+  const int rf = cbatch_flush(s);
+  if (rf < 0) return rf;
   int i;
   int64_t sec_iter = sector_num;
+  // keep relocation out while data is written in place
+  qemu_co_rwlock_rdlock(&(s->reloc_lock));
+  int ret = 0;
   for (i = 0; i < qiov->niov; i++) {
-    if (qiov->iov[i].iov_len % 512) {
-      selfie_log(s, "fatal error@selfie_co_write(): iov not aligned!");
+    if (qiov->iov[i].iov_len % 512) break;
+  }
+  if (i < qiov->niov) {
+    // an iov is not sector aligned: write the whole request through a bounce buffer
+    uint8_t * const bounce = qemu_try_blockalign(bs, qiov->size);
+    if (bounce == NULL) {
+      ret = -ENOMEM;
+    } else {
+      qemu_iovec_to_buf(qiov, 0, bounce, qiov->size);
+      ret = selfie_write(s, sector_num, bounce, nb_sectors);
+      qemu_vfree(bounce);
+    }
+  } else {
+    for (i = 0; i < qiov->niov; i++) {
+      const size_t nr_sec = qiov->iov[i].iov_len>>9;
+      ret = selfie_write(s, sec_iter, qiov->iov[i].iov_base, nr_sec);
+      if (ret < 0) break;
+      sec_iter += nr_sec;
     }
-    const size_t nr_sec = qiov->iov[i].iov_len>>9;
-    selfie_write(s, sec_iter, qiov->iov[i].iov_base, nr_sec);
-    sec_iter += nr_sec;
   }
+  qemu_co_rwlock_unlock(&(s->reloc_lock));
+  return ret;
+}
+
+// whole clusters only: bs->bl.write_zeroes_alignment makes the block layer
+// write the unaligned head and tail through selfie_co_write()
+  static int coroutine_fn
+selfie_co_write_zeroes(BlockDriverState * const bs, const int64_t sector_num,
+    const int nb_sectors, const BdrvRequestFlags flags)
+{
+  if (bs->read_only)
+    return -EACCES;
+  struct SelfieState * const s = bs->opaque;
+  const uint64_t va_start = sector_num * UINT64_C(512);
+  const uint64_t va_end = (sector_num + nb_sectors) * UINT64_C(512);
+  if (va_end > s->header.capacity) {
+    return -EINVAL;
+  }
+  if ((va_start % s->block_size) || (va_end % s->block_size)) {
+    return -ENOTSUP;
+  }
+  const int rf = cbatch_flush(s);
+  if (rf < 0) return rf;
+  qemu_co_rwlock_rdlock(&(s->reloc_lock));
+  uint64_t va;
+  for (va = va_start; va < va_end; va += s->block_size) {
+    const uint64_t va_lock_id = (va >> s->header.block_shift) % I_LOCK_SCALE;
+    __lock(&(s->index_lock[va_lock_id]));
+    // unlocks index_lock
+    data_write_zero(s, va, index_translate(s, va));
+  }
+  qemu_co_rwlock_unlock(&(s->reloc_lock));
   return 0;
 }
+
+struct SelfieCompressedReq {
+  int64_t sector_num;
+  const uint8_t * buf;
+  int nb_sectors;
+  int ret;
+};
+
+  static void coroutine_fn
+selfie_co_write_compressed(struct SelfieState * const s, void * const opaque)
+{
+  struct SelfieCompressedReq * const req = opaque;
+  req->ret = 0;
+  if (req->nb_sectors == 0) { // end of conversion
+    req->ret = cbatch_sync(s);
+    return;
+  }
+  const uint64_t va = req->sector_num * 512;
+  const uint64_t len = req->nb_sectors * 512;
+  // one cluster, the last one may be short
+  if ((va % s->block_size) || (len > s->block_size) || ((va + len) > s->header.capacity)) {
+    req->ret = -EINVAL;
+    return;
+  }
+  const int ri = cbatch_init(s);
+  if (ri < 0) {
+    req->ret = ri;
+    return;
+  }
+  struct SelfieCBatch * const cb = &(s->cbatch);
+  // appends and flushes of the batch are serialized, both can yield
+  __lock(&(cb->lock));
+  if (cb->nr && (cb->va[cb->nr - 1] >= va)) { // keep the batch sorted and unique
+    req->ret = cbatch_flush_locked(s);
+    if (req->ret < 0) {
+      __unlock(&(cb->lock));
+      return;
+    }
+  }
+  const uint64_t pa = index_translate(s, va);
+  if ((pa == 0) && buffer_is_zero(req->buf, len)) { // nothing to store
+    __unlock(&(cb->lock));
+    atomic_inc(&(s->nr_write_zero));
+    return;
+  }
+  if (pa) { // already mapped: ordinary write
+    req->ret = cbatch_flush_locked(s);
+    __unlock(&(cb->lock));
+    if (req->ret < 0) return;
+    qemu_co_rwlock_rdlock(&(s->reloc_lock));
+    req->ret = selfie_write(s, req->sector_num, req->buf, req->nb_sectors);
+    qemu_co_rwlock_unlock(&(s->reloc_lock));
+    return;
+  }
+  uint8_t * const raw = &(cb->raw[cb->nr * s->block_size]);
+  memcpy(raw, req->buf, len);
+  bzero(&(raw[len]), s->block_size - len);
+  cb->va[cb->nr] = va;
+  cb->nr++;
+  if (cb->nr == cb->cap) {
+    req->ret = cbatch_flush_locked(s);
+  }
+  __unlock(&(cb->lock));
+}
+
+  static int
+selfie_write_compressed(BlockDriverState * const bs, const int64_t sector_num,
+    const uint8_t * const buf, const int nb_sectors)
+{
+  struct SelfieState * const s = bs->opaque;
+  struct SelfieCompressedReq req = {
+    .sector_num = sector_num,
+    .buf = buf,
+    .nb_sectors = nb_sectors,
+  };
+  selfie_co_call(s, bs, selfie_co_write_compressed, &req);
+  return req.ret;
+}
+// }}}
+// {{{ defrag job
+#define DEFRAG_SLICE_TIME ((100000000ULL)) // ns
+
+typedef struct SelfieDefragJob {
+  BlockJob common;
+  RateLimit limit;
+  uint64_t threshold; // percent of discontiguous clusters
+} SelfieDefragJob;
+
+typedef struct {
+  int ret;
+} SelfieDefragCompleteData;
+
+// a range is fragmented if too many of its clusters do not follow the
+// previous cluster of the same zone type (z and n data live in different zones)
+  static bool
+defrag_range_fragmented(SelfieDefragJob * const job, struct SelfieState * const s,
+    const uint64_t va_start, const uint64_t va_end)
+{
+  uint64_t prev[4] = {0, 0, 0, 0};
+  uint64_t nr_mapped = 0;
+  uint64_t nr_breaks = 0;
+  uint64_t va;
+  for (va = va_start; va < va_end; va += s->block_size) {
+    const uint64_t pa = index_translate(s, va);
+    if (!index_pa_data(pa)) continue;
+    const uint32_t type = zone_pa_type(s, pa);
+    if (prev[type] && (pa != (prev[type] + s->block_size))) {
+      nr_breaks++;
+    }
+    prev[type] = pa;
+    nr_mapped++;
+  }
+  trace_selfie_defrag_range(job, va_start, nr_mapped, nr_breaks);
+  if (nr_mapped < 2) return false;
+  if (job->threshold == 0) return true;
+  return (nr_breaks * 100) >= (job->threshold * nr_mapped);
+}
+
+// copy the cluster of va to a new unit of the same zone type and map it
+// the old unit is released; a stale z-page is ignored by the scan on open
+// returns 1 if the cluster was moved, 0 if not, -ENOSPC if the image is out of space
+  static int coroutine_fn
+defrag_relocate(struct SelfieState * const s, const uint64_t va, uint8_t * const buf)
+{
+  const uint64_t va_lock_id = (va >> s->header.block_shift) % I_LOCK_SCALE;
+  __lock(&(s->index_lock[va_lock_id]));
+  const uint64_t pa = index_translate(s, va);
+  if (!index_pa_data(pa)) {
+    __unlock(&(s->index_lock[va_lock_id]));
+    return 0;
+  }
+  const int rr = image_pread(s, pa, buf, s->block_size);
+  assert(rr == s->block_size);
+  const uint64_t type = zone_pa_type(s, pa);
+  // do not spread a corrupted n-unit under a fresh checksum
+  // (z-units carry their own and are checked when read)
+  if ((type == ZONE_TYPE_N) && !csum_n_check(s, pa, buf)) {
+    __unlock(&(s->index_lock[va_lock_id]));
+    trace_selfie_checksum_error(s, va, pa);
+    atomic_inc(&(s->nr_csum_errors));
+    return 0;
+  }
+  // hot clusters stay with hot data, the rest go to the relocation stream
+  const uint64_t cls = (heat_class(heat_get(s, va)) == STREAM_HOT) ? STREAM_HOT : STREAM_RELOC;
+  uint64_t new_pa = 0;
+  switch (type) {
+    case ZONE_TYPE_Z: new_pa = zone_alloc_z(s, va, cls); break;
+    case ZONE_TYPE_N: new_pa = zone_alloc_n(s, va, cls); break;
+    default: assert(false); break;
+  }
+  if (new_pa == 0) {
+    __unlock(&(s->index_lock[va_lock_id]));
+    return -ENOSPC;
+  }
+  const int rw = image_pwrite(s, new_pa, buf, s->block_size);
+  assert(rw == s->block_size);
+  if (type == ZONE_TYPE_N) {
+    csum_n_update(s, new_pa, buf);
+  }
+  // unlocks index_lock
+  index_map_hard(s, va, new_pa);
+  return 1;
+}
+
+// a range is relocated only if a new zone per stream type remains for it;
+// units freed by earlier ranges come back through zone_reclaim_sync()
+  static bool
+defrag_has_space(struct SelfieState * const s)
+{
+  const uint64_t need = 2 * DIV_ROUND_UP(512, s->nr_zone_unit_n);
+  return atomic_read(&(s->nr_zones_free)) >= (need + SELFIE_ZONE_RESERVE);
+}
+
+// rewrite all clusters of [va_start, va_end) in va order, *nr counts the moved ones
+// guest writes are held back so the new units are contiguous
+  static int coroutine_fn
+defrag_range(struct SelfieState * const s, const uint64_t va_start, const uint64_t va_end,
+    uint8_t * const buf, uint64_t * const nr)
+{
+  int ret = 0;
+  uint64_t va;
+  *nr = 0;
+  qemu_co_rwlock_wrlock(&(s->reloc_lock));
+  for (va = va_start; va < va_end; va += s->block_size) {
+    ret = defrag_relocate(s, va, buf);
+    if (ret < 0) break;
+    *nr += ret;
+  }
+  qemu_co_rwlock_unlock(&(s->reloc_lock));
+  return (ret < 0) ? ret : 0;
+}
+
+  static void
+defrag_complete(BlockJob * const job, void * const opaque)
+{
+  SelfieDefragCompleteData * const data = opaque;
+  block_job_completed(job, data->ret);
+  g_free(data);
+}
+
+  static void coroutine_fn
+defrag_run(void * const opaque)
+{
+  SelfieDefragJob * const job = opaque;
+  BlockDriverState * const bs = job->common.bs;
+  struct SelfieState * const s = bs->opaque;
+  const uint64_t range = s->block_size * 512; // covered by one l2 page
+  uint8_t * const buf = qemu_blockalign(bs, s->block_size);
+  job->common.len = s->header.capacity;
+  uint64_t delay_ns = 0;
+  int ret = 0;
+  uint64_t va;
+  for (va = 0; va < s->header.capacity; va += range) {
+    // yield with no pending I/O so that bdrv_drain_all() returns
+    block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
+    if (block_job_is_cancelled(&job->common)) {
+      break;
+    }
+    delay_ns = 0;
+    const uint64_t va_end = MIN(va + range, s->header.capacity);
+    if (defrag_range_fragmented(job, s, va, va_end)) {
+      ret = zone_reclaim_sync(s);
+      if (ret < 0) {
+        break;
+      }
+      if (!defrag_has_space(s)) {
+        ret = -ENOSPC;
+        break;
+      }
+      uint64_t nr;
+      ret = defrag_range(s, va, va_end, buf, &nr);
+      if (ret < 0) {
+        break;
+      }
+      if (job->common.speed) {
+        delay_ns = ratelimit_calculate_delay(&job->limit, (nr * s->block_size) >> BDRV_SECTOR_BITS);
+      }
+    }
+    // publish progress
+    job->common.offset = va_end;
+  }
+  qemu_vfree(buf);
+
+  SelfieDefragCompleteData * const data = g_new0(SelfieDefragCompleteData, 1);
+  data->ret = ret;
+  block_job_defer_to_main_loop(&job->common, defrag_complete, data);
+}
+
+  static void
+defrag_set_speed(BlockJob * const job, const int64_t speed, Error **errp)
+{
+  SelfieDefragJob * const s = container_of(job, SelfieDefragJob, common);
+  if (speed < 0) {
+    error_set(errp, QERR_INVALID_PARAMETER, "speed");
+    return;
+  }
+  ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, DEFRAG_SLICE_TIME);
+}
+
+static const BlockJobDriver selfie_defrag_job_driver = {
+  .instance_size = sizeof(SelfieDefragJob),
+  .job_type      = BLOCK_JOB_TYPE_DEFRAG,
+  .set_speed     = defrag_set_speed,
+};
+
+static BlockDriver bdrv_selfie;
+
+  void
+selfie_defrag_start(BlockDriverState *bs, int64_t threshold, int64_t speed,
+    BlockCompletionFunc *cb, void *opaque, Error **errp)
+{
+  if (bs->drv != &bdrv_selfie) {
+    error_setg(errp, "Device '%s' is not a selfie image", bdrv_get_device_name(bs));
+    return;
+  }
+  if (bs->read_only) {
+    error_setg(errp, "Device '%s' is read-only", bdrv_get_device_name(bs));
+    return;
+  }
+  SelfieDefragJob * const job = block_job_create(&selfie_defrag_job_driver, bs, speed, cb, opaque, errp);
+  if (job == NULL) {
+    return;
+  }
+  job->threshold = threshold;
+  job->common.co = qemu_coroutine_create(defrag_run);
+  trace_selfie_defrag_start(bs, job, threshold);
+  qemu_coroutine_enter(job->common.co, job);
+}
 // }}}
 // {{{ selfie_create API
   static int
 selfie_create(const char *filename, QemuOpts *opts, Error **errp)
 {
-  const int fd_log = open("/tmp/selfie-debug.log", O_CREAT | O_APPEND | O_WRONLY | O_DSYNC, 00644);
   // create and open image file
   Error *local_err = NULL;
   const int rc = bdrv_create_file(filename, NULL, &local_err);
@@ -1092,20 +2857,23 @@ selfie_create(const char *filename, QemuOpts *opts, Error **errp)
   const uint64_t cluster_size = qemu_opt_get_size_del(opts, BLOCK_OPT_CLUSTER_SIZE, 4 * 1024);
   const uint64_t zone_size = qemu_opt_get_size_del(opts, "zone_size", 4*1024*1024);
   char * const init_opt = qemu_opt_get_del(opts, "init");
-  dprintf(fd_log, "capacity: %"PRIu64"\n", capacity);
-  dprintf(fd_log, "cluster_size: %"PRIu64"\n", cluster_size);
-  dprintf(fd_log, "zone_size: %"PRIu64"\n", zone_size);
-  dprintf(fd_log, "init_opt: %s\n", init_opt?init_opt:"");
+  char * const meta_opt = qemu_opt_get_del(opts, "metadata_file");
+  const bool checksum = qemu_opt_get_bool_del(opts, "checksum", false);
 
+  if (meta_opt && (strlen(meta_opt) >= SELFIE_META_PATH_SIZE)) return -EINVAL;
   if (cluster_size < SELFIE_PAGE_SIZE) return -EINVAL; // >= 4K
   if (cluster_size & (cluster_size - 1)) return -EINVAL; // must be 2^x
   if (zone_size < cluster_size) return -EINVAL;
   if (zone_size & (zone_size - 1)) return -EINVAL; // must be 2^x
+  if ((zone_size / SELFIE_PAGE_SIZE) >= (UINT64_C(1) << 28)) return -EINVAL; // zones[].n
   if (capacity == 0) return -EINVAL; // non zero
   if ((capacity % cluster_size) != 0) return -EINVAL; // multiple of cluster_size
+  // a n-zone must keep room for data after its checksum table
+  if (checksum && (zone_size < (cluster_size * 2))) return -EINVAL;
 
   // prepare header
   struct SelfieHeader zh;
+  bzero(&zh, sizeof(zh));
   memcpy(zh.magic, SELFIE_MAGIC, sizeof(SELFIE_MAGIC));
   // ->capacity
   zh.capacity = capacity;
@@ -1115,15 +2883,13 @@ selfie_create(const char *filename, QemuOpts *opts, Error **errp)
   assert((1 << sh) == cluster_size);
   zh.block_shift = sh;
   // ->nr_l1
-  const uint64_t size_l1 = cluster_size * 512 * 512;
-  uint64_t nr_l1 = 1;
-  while ((nr_l1 * size_l1) < capacity) nr_l1++;
+  const uint64_t nr_l1 = layout_nr_l1(cluster_size, capacity);
   zh.nr_l1 = nr_l1;
   // ->zone_size
   zh.zone_size = zone_size;
   // ->nr_zones
-  zh.nr_zones = (capacity / zone_size) * 2 + 1;
-  const uint64_t zone_pages = (zh.nr_zones * sizeof(struct SelfieZoneInfo)) / SELFIE_PAGE_SIZE + 1;
+  zh.nr_zones = layout_nr_zones(zone_size, capacity);
+  const uint64_t zone_pages = layout_zone_pages(zh.nr_zones);
   // ->pa_zi
   zh.pa_zi = SELFIE_PAGE_SIZE;
   // ->pa_l1
@@ -1133,37 +2899,349 @@ selfie_create(const char *filename, QemuOpts *opts, Error **errp)
   // ->init_type
   uint64_t init_type = INIT_ZERO; // default
   if (init_opt) {
-    if (strcmp(init_opt, "trim") == 0) {
-      init_type = INIT_TRIM;
-    } else if (strcmp(init_opt, "none") == 0) {
-      init_type = INIT_NONE;
-    } // otherwise -> none
+    layout_parse_init(init_opt, &init_type); // otherwise -> zero
   }
   zh.init_type = init_type;
+  // ->flags, ->meta_file
+  if (checksum) {
+    zh.flags |= SELFIE_F_CHECKSUM;
+  }
+  BlockDriverState * meta = bs;
+  if (meta_opt) {
+    zh.flags |= SELFIE_F_META_FILE;
+    pstrcpy(zh.meta_file, sizeof(zh.meta_file), meta_opt);
+    char * const meta_filename = g_malloc(PATH_MAX);
+    path_combine(meta_filename, PATH_MAX, filename, meta_opt);
+    const int rmc = bdrv_create_file(meta_filename, NULL, &local_err);
+    meta = NULL;
+    const int rmo = (rmc < 0) ? rmc :
+      bdrv_open(&meta, meta_filename, NULL, NULL, BDRV_O_RDWR | BDRV_O_PROTOCOL, NULL, &local_err);
+    g_free(meta_filename);
+    g_free(meta_opt);
+    if (rmo < 0) {
+      error_propagate(errp, local_err);
+      bdrv_unref(bs);
+      return rmo;
+    }
+  }
   // write header
   const int rh = bdrv_pwrite(bs, 0, &zh, sizeof(zh));
   if (rh != sizeof(zh)) return rh;
-  dprintf(fd_log, "capacity: %"PRIu64"\n", zh.capacity);
-  dprintf(fd_log, "shift: %"PRIu64"\n", zh.block_shift);
-  dprintf(fd_log, "nr_l1: %"PRIu64"\n", zh.nr_l1);
-  dprintf(fd_log, "zone_size: %"PRIu64"\n", zh.zone_size);
-  dprintf(fd_log, "nr_zones: %"PRIu64"\n", zh.nr_zones);
-  dprintf(fd_log, "pa_zi: %"PRIu64"\n", zh.pa_zi);
-  dprintf(fd_log, "pa_l1: %"PRIu64"\n", zh.pa_l1);
-  dprintf(fd_log, "pa_zones: %"PRIu64"\n", zh.pa_zones);
-  dprintf(fd_log, "init_type: %"PRIu64"\n", zh.init_type);
+  trace_selfie_create(zh.capacity, cluster_size, zh.zone_size, zh.init_type);
 
   // write zoneinfo and l1 (zeroes)
   const uint64_t zeroes_size = (zone_pages + nr_l1) * SELFIE_PAGE_SIZE;
   void * const zeroes = g_malloc0(zeroes_size);
-  bdrv_pwrite(bs, zh.pa_zi, zeroes, zeroes_size);
+  bdrv_pwrite(meta, zh.pa_zi, zeroes, zeroes_size);
   free(zeroes);
   // close
+  if (meta != bs) {
+    bdrv_unref(meta);
+  }
   bdrv_unref(bs);
-  close(fd_log);
   return 0;
 }
 // }}}
+// {{{ selfie_truncate/amend API
+// write a new header; the regions it points to must be on disk already
+  static int
+header_sync(struct SelfieState * const s, const struct SelfieHeader * const header)
+{
+  const int rh = bdrv_pwrite_sync(s->main, 0, header, sizeof(*header));
+  return (rh < 0) ? rh : 0;
+}
+
+// grow nodes[] to nr_l1 entries, new l1 pages are empty
+// no request is in flight, so the write locks can be re-initialized after the move
+  static void
+resize_grow_index(struct SelfieState * const s, const uint64_t nr_l1)
+{
+  const uint64_t old_nr_l1 = s->header.nr_l1;
+  struct SelfieIndexL1 * const nodes = g_malloc0(sizeof(nodes[0]) * nr_l1);
+  memcpy(nodes, s->nodes, sizeof(nodes[0]) * old_nr_l1);
+  uint64_t i;
+  for (i = 0; i < nr_l1; i++) {
+    qemu_co_mutex_init(&(nodes[i].write_lock));
+    if (i >= old_nr_l1) {
+      nodes[i].l1_page = aligned_alloc(SELFIE_PAGE_SIZE, SELFIE_PAGE_SIZE);
+      assert(nodes[i].l1_page);
+      s->nr_index_pages++;
+      bzero(nodes[i].l1_page, SELFIE_PAGE_SIZE);
+    }
+  }
+  g_free(s->nodes);
+  s->nodes = nodes;
+}
+
+// grow zones[] to nr_zones entries, new zones are unused
+  static void
+resize_grow_zones(struct SelfieState * const s, const uint64_t nr_zones)
+{
+  const uint64_t old_nr_zones = s->header.nr_zones;
+  s->zones = g_realloc(s->zones, sizeof(s->zones[0]) * nr_zones);
+  bzero(&(s->zones[old_nr_zones]), sizeof(s->zones[0]) * (nr_zones - old_nr_zones));
+  s->nr_zones_free += nr_zones - old_nr_zones;
+  if (s->zone_live) {
+    s->zone_live = g_renew(uint32_t, s->zone_live, nr_zones);
+    bzero(&(s->zone_live[old_nr_zones]), sizeof(s->zone_live[0]) * (nr_zones - old_nr_zones));
+  }
+  if (s->ncsum) {
+    s->ncsum = g_renew(uint32_t *, s->ncsum, nr_zones);
+    bzero(&(s->ncsum[old_nr_zones]), sizeof(s->ncsum[0]) * (nr_zones - old_nr_zones));
+  }
+}
+
+// write zone info and all l1 pages at the locations given by header
+// the in-memory tables still have the sizes of s->header: entries beyond them
+// are written as unused zones and empty l1 pages
+  static int
+resize_write_regions(struct SelfieState * const s, const struct SelfieHeader * const header)
+{
+  // both regions are beyond the zones: they go to the metadata file if there is one
+  BlockDriverState * const file = s->meta ? s->meta : s->main;
+  const uint64_t zi_size = layout_zone_pages(header->nr_zones) * SELFIE_PAGE_SIZE;
+  uint8_t * const zi = qemu_blockalign0(file, zi_size);
+  memcpy(zi, s->zones, sizeof(s->zones[0]) * s->header.nr_zones);
+  const int rz = bdrv_pwrite(file, header->pa_zi, zi, zi_size);
+  if (rz < 0) {
+    qemu_vfree(zi);
+    return rz;
+  }
+  bzero(zi, SELFIE_PAGE_SIZE); // the empty l1 page
+  uint64_t i;
+  for (i = 0; i < header->nr_l1; i++) {
+    const uint64_t pa_l1 = header->pa_l1 + (i * SELFIE_PAGE_SIZE);
+    const void * const l1_page = (i < s->header.nr_l1) ? (const void *)s->nodes[i].l1_page : zi;
+    const int rw = bdrv_pwrite(file, pa_l1, l1_page, SELFIE_PAGE_SIZE);
+    if (rw < 0) {
+      qemu_vfree(zi);
+      return rw;
+    }
+    atomic_inc(&(s->nr_write_l1));
+  }
+  qemu_vfree(zi);
+  return bdrv_flush(file);
+}
+
+// grow the image to offset bytes
+// zone info and l1 can not grow in place (zones follow them), so they are
+// copied behind the last zone of the new layout, or behind the old regions
+// if those were relocated before and end later, and the header is switched
+// over once the copy is stable. A crash before the switch leaves the old
+// header and regions intact.
+  static int
+selfie_truncate(BlockDriverState * const bs, const int64_t offset)
+{
+  struct SelfieState * const s = bs->opaque;
+  if ((offset < 0) || (offset % s->block_size)) {
+    error_report("The new size must be a multiple of the cluster size");
+    return -EINVAL;
+  }
+  if (offset < s->header.capacity) {
+    error_report("selfie doesn't support shrinking images");
+    return -ENOTSUP;
+  }
+  if (offset == s->header.capacity) return 0;
+  // mapped pages would follow the old layout
+  index_unmap(s);
+
+  struct SelfieHeader nh = s->header;
+  nh.capacity = offset;
+  nh.nr_l1 = layout_nr_l1(s->block_size, nh.capacity);
+  nh.nr_zones = layout_nr_zones(nh.zone_size, nh.capacity);
+  const bool relocate = (nh.nr_l1 > s->header.nr_l1) || (nh.nr_zones > s->header.nr_zones);
+  // the old regions stay live until the header switch: never write over them
+  const struct SelfieHeader oh = s->header;
+  const bool old_relocated = (oh.pa_zi > oh.pa_zones);
+  const uint64_t old_size = (layout_zone_pages(oh.nr_zones) + oh.nr_l1) * SELFIE_PAGE_SIZE;
+  const uint64_t old_end = oh.pa_zi + old_size;
+  if (relocate) {
+    nh.pa_zi = nh.pa_zones + (nh.nr_zones * nh.zone_size);
+    if (old_relocated && (nh.pa_zi < old_end)) {
+      nh.pa_zi = old_end;
+    }
+    nh.pa_l1 = nh.pa_zi + (layout_zone_pages(nh.nr_zones) * SELFIE_PAGE_SIZE);
+    const int rr = resize_write_regions(s, &nh);
+    if (rr < 0) return rr;
+  }
+  const int rh = header_sync(s, &nh);
+  if (rh < 0) return rh;
+  // the in-memory tables follow the image only once it switched over:
+  // a failure above leaves both at the old size
+  if (nh.nr_l1 > s->header.nr_l1) {
+    resize_grow_index(s, nh.nr_l1);
+  }
+  if (nh.nr_zones > s->header.nr_zones) {
+    resize_grow_zones(s, nh.nr_zones);
+  }
+
+  // a previously relocated region may now lie inside the zone range;
+  // clear it so a later scan of that zone never sees stale metadata.
+  // the new regions start at or after old_end, so nothing live is cleared
+  BlockDriverState * const old_file = image_file(s, oh.pa_zi);
+  s->header = nh;
+  bs->total_sectors = s->header.capacity / 512;
+  if (relocate && old_relocated) {
+    assert(nh.pa_zi >= old_end);
+    const int rz = bdrv_write_zeroes(old_file, oh.pa_zi >> 9, old_size >> 9, 0);
+    if (rz < 0) return rz;
+  }
+  return 0;
+}
+
+  static int
+selfie_amend_options(BlockDriverState * const bs, QemuOpts * const opts,
+    BlockDriverAmendStatusCB * const status_cb)
+{
+  struct SelfieState * const s = bs->opaque;
+  uint64_t new_size = 0;
+  uint64_t init_type = s->header.init_type;
+  const QemuOptDesc * desc;
+  for (desc = opts->list->desc; desc && desc->name; desc++) {
+    if (!qemu_opt_find(opts, desc->name)) {
+      // only change explicitly defined options
+      continue;
+    }
+    if (!strcmp(desc->name, BLOCK_OPT_SIZE)) {
+      new_size = qemu_opt_get_size(opts, BLOCK_OPT_SIZE, 0);
+    } else if (!strcmp(desc->name, BLOCK_OPT_CLUSTER_SIZE)) {
+      if (qemu_opt_get_size(opts, BLOCK_OPT_CLUSTER_SIZE, s->block_size) != s->block_size) {
+        error_report("Changing the cluster size is not supported");
+        return -ENOTSUP;
+      }
+    } else if (!strcmp(desc->name, "zone_size")) {
+      if (qemu_opt_get_size(opts, "zone_size", s->header.zone_size) != s->header.zone_size) {
+        error_report("Changing the zone size is not supported");
+        return -ENOTSUP;
+      }
+    } else if (!strcmp(desc->name, "init")) {
+      const char * const init_opt = qemu_opt_get(opts, "init");
+      if (init_opt && layout_parse_init(init_opt, &init_type) < 0) {
+        error_report("Unknown init policy '%s'", init_opt);
+        return -EINVAL;
+      }
+    } else if (!strcmp(desc->name, "metadata_file")) {
+      const char * const meta_opt = qemu_opt_get(opts, "metadata_file");
+      if (!(s->header.flags & SELFIE_F_META_FILE) || strcmp(meta_opt, s->header.meta_file)) {
+        error_report("Changing the metadata file is not supported");
+        return -ENOTSUP;
+      }
+    } else if (!strcmp(desc->name, "checksum")) {
+      if (qemu_opt_get_bool(opts, "checksum", false) != csum_enabled(s)) {
+        error_report("Changing checksums is not supported");
+        return -ENOTSUP;
+      }
+    } else {
+      // a new create option must be covered here
+      assert(false);
+    }
+  }
+
+  if (init_type != s->header.init_type) {
+    struct SelfieHeader nh = s->header;
+    nh.init_type = init_type;
+    const int rh = header_sync(s, &nh);
+    if (rh < 0) return rh;
+    s->header = nh;
+  }
+
+  if (new_size) {
+    const int rt = selfie_truncate(bs, new_size);
+    if (rt < 0) return rt;
+  }
+  return 0;
+}
+// }}}
+// {{{ statistics API
+  static const char *
+stats_init_str(const uint64_t init_type)
+{
+  switch (init_type) {
+    case INIT_NONE: return "none";
+    case INIT_TRIM: return "trim";
+    case INIT_ZERO: return "zero";
+    default: return "unknown";
+  }
+}
+
+// bytes of l1/l2 pages held in memory
+// kept up to date by the index and heat allocations: no walk per query
+  static uint64_t
+stats_index_memory(struct SelfieState * const s)
+{
+  return (atomic_read(&(s->nr_index_pages)) * SELFIE_PAGE_SIZE)
+    + (atomic_read(&(s->nr_index_heat)) * sizeof(struct SelfieHeat))
+    + (sizeof(s->nodes[0]) * s->header.nr_l1) + (sizeof(s->zones[0]) * s->header.nr_zones);
+}
+
+// all counters are updated as zones and units are handed out and freed
+// callers hold the AioContext of the image
+  static SelfieStats *
+stats_collect(struct SelfieState * const s)
+{
+  SelfieStats * const st = g_new0(SelfieStats, 1);
+  st->write_data_z = atomic_read(&(s->nr_write_data_z));
+  st->write_data_n = atomic_read(&(s->nr_write_data_n));
+  st->write_zone = atomic_read(&(s->nr_write_zone));
+  st->write_l1 = atomic_read(&(s->nr_write_l1));
+  st->write_l2 = atomic_read(&(s->nr_write_l2));
+  st->zones_free = atomic_read(&(s->nr_zones_free));
+  st->zones_z = atomic_read(&(s->nr_zones_of[ZONE_TYPE_Z]));
+  st->zones_n = atomic_read(&(s->nr_zones_of[ZONE_TYPE_N]));
+  st->zones_l = atomic_read(&(s->nr_zones_of[ZONE_TYPE_L]));
+  st->units_z = atomic_read(&(s->nr_units_of[ZONE_TYPE_Z]));
+  st->units_n = atomic_read(&(s->nr_units_of[ZONE_TYPE_N]));
+  st->pages_l = atomic_read(&(s->nr_units_of[ZONE_TYPE_L]));
+  st->zone_units = s->nr_zone_unit;
+  st->zone_pages = s->nr_zone_page;
+  st->compress_attempts = atomic_read(&(s->nr_compress));
+  st->compress_hits = atomic_read(&(s->nr_compress_hit));
+  st->z_to_n = atomic_read(&(s->nr_z_to_n));
+  st->leaked_units = atomic_read(&(s->nr_leaked));
+  st->scan_leaked_units = s->nr_leaked_scan;
+  st->zones_reclaimed = atomic_read(&(s->nr_reclaimed));
+  st->hot_units = atomic_read(&(s->nr_alloc_hot));
+  st->checksum_errors = atomic_read(&(s->nr_csum_errors));
+  st->checksum_repairs = atomic_read(&(s->nr_csum_repairs));
+  st->zero_writes = atomic_read(&(s->nr_write_zero));
+  st->index_memory = stats_index_memory(s);
+  return st;
+}
+
+  static ImageInfoSpecific *
+selfie_get_specific_info(BlockDriverState * const bs)
+{
+  struct SelfieState * const s = bs->opaque;
+  ImageInfoSpecific * const spec_info = g_new(ImageInfoSpecific, 1);
+  *spec_info = (ImageInfoSpecific){
+    .kind = IMAGE_INFO_SPECIFIC_KIND_SELFIE,
+    {
+      .selfie = g_new(ImageInfoSpecificSelfie, 1),
+    },
+  };
+  *spec_info->selfie = (ImageInfoSpecificSelfie){
+    .zone_size = s->header.zone_size,
+    .init = g_strdup(stats_init_str(s->header.init_type)),
+    .checksum = csum_enabled(s),
+    .stats = stats_collect(s),
+  };
+  return spec_info;
+}
+
+  static BlockStatsSpecific *
+selfie_get_specific_stats(BlockDriverState * const bs)
+{
+  struct SelfieState * const s = bs->opaque;
+  BlockStatsSpecific * const stats = g_new(BlockStatsSpecific, 1);
+  *stats = (BlockStatsSpecific){
+    .kind = BLOCK_STATS_SPECIFIC_KIND_SELFIE,
+    {
+      .selfie = stats_collect(s),
+    },
+  };
+  return stats;
+}
+// }}}
 // {{{ misc. API
   static int
 selfie_get_info(BlockDriverState * const bs, BlockDriverInfo * const bdi)
@@ -1172,11 +3250,18 @@ selfie_get_info(BlockDriverState * const bs, BlockDriverInfo * const bdi)
   bdi->cluster_size = s->block_size;
   bdi->vm_state_offset = 0;
   bdi->unallocated_blocks_are_zero = true;
-  bdi->can_write_zeroes_with_unmap = false; // ?
+  bdi->can_write_zeroes_with_unmap = true; // zeroed clusters have no data unit
   bdi->needs_compressed_writes = false;
   return 0;
 }
 
+  static void
+selfie_refresh_limits(BlockDriverState * const bs, Error ** const errp)
+{
+  struct SelfieState * const s = bs->opaque;
+  bs->bl.write_zeroes_alignment = s->block_size >> 9;
+}
+
   static int
 selfie_probe(const uint8_t * const buf, const int buf_size, const char *filename)
 {
@@ -1186,27 +3271,85 @@ selfie_probe(const uint8_t * const buf, const int buf_size, const char *filename
   else return 0;
 }
 
+  static void coroutine_fn
+selfie_co_close_sync(struct SelfieState * const s, void * const opaque)
+{
+  cbatch_sync(s);
+  if (s->header.flags & SELFIE_F_DIRTY) {
+    if ((bdrv_co_flush(s->main) == 0) && ((s->meta == NULL) || (bdrv_co_flush(s->meta) == 0))) {
+      csum_mark_dirty(s, false);
+    }
+  }
+}
+
   static void
 selfie_close(BlockDriverState * const bs)
 {
   struct SelfieState * const s = bs->opaque;
+  selfie_co_call(s, bs, selfie_co_close_sync, NULL);
+  cbatch_free(s);
   // print stat
   index_mapping_print(s, "CLOSE");
-  selfie_log(s, "W_Z %"PRIu64" W_N %"PRIu64" W_ZONE %"PRIu64" W_L1 %"PRIu64" W_L2 %"PRIu64,
-      s->nr_write_data_z, s->nr_write_data_n, s->nr_write_zone, s->nr_write_l1, s->nr_write_l2);
+  trace_selfie_close(s, s->nr_write_data_z, s->nr_write_data_n, s->nr_write_zone,
+      s->nr_write_l1, s->nr_write_l2);
   index_free(s);
-  selfie_log(s, "CLOSE: index freed");
+  if (s->imap) {
+    munmap(s->imap, s->imap_size);
+    g_free(s->zones_open);
+  }
   free(s->zones);
-  selfie_log(s, "CLOSE: zones freed");
-  //close
-  selfie_log(s, "#### closed ####");
-  close(s->fd_log);
+  g_free(s->zone_live);
+  g_free(s->orphans);
+  csum_free(s);
+  ra_free(s);
+  if (s->meta) {
+    bdrv_unref(s->meta);
+    s->meta = NULL;
+  }
 }
 
   static int64_t
 selfie_get_allocated_file_size(BlockDriverState * const bs)
 {
-  return bdrv_get_allocated_file_size(bs->file);
+  struct SelfieState * const s = bs->opaque;
+  const int64_t size = bdrv_get_allocated_file_size(bs->file);
+  if ((size < 0) || (s->meta == NULL)) return size;
+  const int64_t meta_size = bdrv_get_allocated_file_size(s->meta);
+  return (meta_size < 0) ? meta_size : (size + meta_size);
+}
+
+// bs->file moves with bs, the metadata file is ours
+// requests are drained by bdrv_set_aio_context(); the defrag job follows
+// bdrv_get_aio_context() and compressed batches are encoded on the pool of
+// the current context, so only the child needs to move
+  static void
+selfie_detach_aio_context(BlockDriverState * const bs)
+{
+  struct SelfieState * const s = bs->opaque;
+  if (s->meta) {
+    bdrv_detach_aio_context(s->meta);
+  }
+}
+
+  static void
+selfie_attach_aio_context(BlockDriverState * const bs, AioContext * const new_context)
+{
+  struct SelfieState * const s = bs->opaque;
+  if (s->meta) {
+    bdrv_attach_aio_context(s->meta, new_context);
+  }
+}
+
+// bs->file is flushed by the block layer, the metadata file is ours
+  static coroutine_fn int
+selfie_co_flush_to_disk(BlockDriverState * const bs)
+{
+  struct SelfieState * const s = bs->opaque;
+  int ret = cbatch_sync(s);
+  if (ret < 0) return ret;
+  ret = zone_reclaim_sync(s);
+  if (ret < 0) return ret;
+  return s->meta ? bdrv_co_flush(s->meta) : 0;
 }
 
 // }}}
@@ -1236,6 +3379,17 @@ static QemuOptsList selfie_create_opts = {
       .type = QEMU_OPT_STRING,
       .help = "Initialize with {trim|zero|none}",
     },
+    {
+      .name = "metadata_file",
+      .type = QEMU_OPT_STRING,
+      .help = "Keep zone info, L1 and L2 in a separate file (e.g. on faster storage)",
+    },
+    {
+      .name = "checksum",
+      .type = QEMU_OPT_BOOL,
+      .help = "Keep a crc32c of every cluster and verify it on read",
+      .def_value_str = "off",
+    },
     { /* end of list */ }
   }
 };
@@ -1244,14 +3398,23 @@ static BlockDriver bdrv_selfie = {
   .format_name = "selfie",
   .instance_size = sizeof(struct SelfieState),
   .bdrv_get_info = selfie_get_info,
+  .bdrv_refresh_limits = selfie_refresh_limits,
+  .bdrv_get_specific_info = selfie_get_specific_info,
+  .bdrv_get_specific_stats = selfie_get_specific_stats,
   .bdrv_probe = selfie_probe,
   .bdrv_open   = selfie_open,
   .bdrv_create = selfie_create,
   .bdrv_co_readv   = selfie_co_read,
   .bdrv_co_writev  = selfie_co_write,
+  .bdrv_co_write_zeroes = selfie_co_write_zeroes,
+  .bdrv_write_compressed = selfie_write_compressed,
   .bdrv_close  = selfie_close,
   .bdrv_get_allocated_file_size = selfie_get_allocated_file_size,
-  //.bdrv_co_flush_to_disk = selfie_co_flush_to_disk,
+  .bdrv_truncate = selfie_truncate,
+  .bdrv_amend_options = selfie_amend_options,
+  .bdrv_co_flush_to_disk = selfie_co_flush_to_disk,
+  .bdrv_detach_aio_context = selfie_detach_aio_context,
+  .bdrv_attach_aio_context = selfie_attach_aio_context,
 
   .bdrv_has_zero_init = bdrv_has_zero_init_1,
   .create_opts = &selfie_create_opts,
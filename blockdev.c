@@ -405,12 +405,18 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
+        if (!strcmp(buf, "threads")) {
             /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+        } else if (!strcmp(buf, "native")) {
+            bdrv_flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+#endif
         } else {
            error_setg(errp, "invalid aio option");
            goto early_err;
@@ -2018,6 +2024,46 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_selfie_defrag(const char *device,
+                       bool has_threshold, int64_t threshold,
+                       bool has_speed, int64_t speed,
+                       Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    Error *local_err = NULL;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_DEFRAG, errp)) {
+        goto out;
+    }
+
+    if (has_threshold && (threshold < 0 || threshold > 100)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "threshold");
+        goto out;
+    }
+
+    selfie_defrag_start(bs, has_threshold ? threshold : 25,
+                        has_speed ? speed : 0, block_job_cb, bs, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    trace_qmp_selfie_defrag(bs, bs->job);
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_commit(const char *device,
                       bool has_base, const char *base,
                       bool has_top, const char *top,
@@ -2728,7 +2774,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
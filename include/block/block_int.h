@@ -184,6 +184,12 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Set if bdrv_write_compressed() may be called again while an earlier
+     * call is still running in another coroutine. The clusters must still
+     * be allocated in the order of the calls.
+     */
+    bool supports_concurrent_compressed_writes;
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -201,6 +207,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -503,6 +510,23 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/**
+ * selfie_defrag_start:
+ * @bs: Selfie image to operate on.
+ * @threshold: Percentage of discontiguous clusters that makes a range
+ * fragmented.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a defragmentation job on @bs.  Fragmented ranges of the image are
+ * rewritten into fresh zones and the index is updated to point to them.
+ */
+void selfie_defrag_start(BlockDriverState *bs, int64_t threshold,
+                         int64_t speed, BlockCompletionFunc *cb,
+                         void *opaque, Error **errp);
+
 /**
  * commit_start:
  * @bs: Active block device.
@@ -33,6 +33,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "qemu/timer.h"
 #include <getopt.h>
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_VERSION \
@@ -46,6 +47,10 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_FLUSH_INTERVAL = 258,
+    OPTION_PATTERN = 259,
+    OPTION_MIX = 260,
+    OPTION_RANDOM = 261,
 };
 
 typedef enum OutputFormat {
@@ -128,6 +133,8 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert (default 1, maximum 16)\n"
+           "  '-W' allows convert to write to the target out of order\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -142,9 +149,24 @@ static void QEMU_NORETURN help(void)
            "  '-d' deletes a snapshot\n"
            "  '-l' lists all snapshots in the given image\n"
            "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests (default 75000)\n"
+           "  '-d' number of requests in flight (default 64)\n"
+           "  '-i' AIO mode, 'threads' (default), 'native' or 'io_uring'\n"
+           "  '-o' offset of the first request in bytes (default 0)\n"
+           "  '-s' request size in bytes (default 4k)\n"
+           "  '-S' distance between the offsets of consecutive requests\n"
+           "       (default: the request size, i.e. sequential)\n"
+           "  '-w' writes instead of reads\n"
+           "  '--mix=pct' percentage of writes among the requests\n"
+           "  '--random' random offsets instead of sequential or strided ones\n"
+           "  '--flush-interval=n' flush after every n completed writes\n"
+           "  '--pattern=byte|random' data written by write requests\n"
+           "\n"
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
+           "  '-m' number of chunks compared in parallel (default 8, maximum 16)\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
 
     printf("%s\nSupported formats:", help_msg);
@@ -984,6 +1006,16 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         return 0;
     }
 
+    /*
+     * Identical buffers are the common case; a single memcmp() over all of
+     * them runs at memory bandwidth, so only look at single sectors once
+     * there is a difference somewhere.
+     */
+    if (!memcmp(buf1, buf2, n * BDRV_SECTOR_SIZE)) {
+        *pnum = n;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, 512);
     for(i = 1; i < n; i++) {
         buf1 += 512;
@@ -1011,37 +1043,177 @@ static int64_t sectors_to_process(int64_t total, int64_t from)
 }
 
 /*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
- *
- * Returns 0 in case sectors are filled with 0, 1 if sectors contain non-zero
- * data and negative value on error.
+ * Check if passed sectors are known to read as zeroes from the block status of
+ * the image, or of its backing files where the image itself is unallocated.
  *
- * @param bs:  Driver used for accessing file
- * @param sect_num: Number of first sector to check
- * @param sect_count: Number of sectors to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * Returns 1 in that case, 0 if the sectors have to be read to tell and a
+ * negative value on error. pnum is set to the number of sectors (starting
+ * with the first one) with the same result.
+ */
+static int sectors_read_as_zero(BlockDriverState *bs, int64_t sect_num,
+                                int sect_count, int *pnum)
+{
+    int64_t ret;
+
+    for (;;) {
+        ret = bdrv_get_block_status(bs, sect_num, sect_count, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret & BDRV_BLOCK_ZERO) {
+            return 1;
+        }
+        if ((ret & BDRV_BLOCK_DATA) || !bs->backing_hd || *pnum == 0) {
+            break;
+        }
+        sect_count = *pnum;
+        bs = bs->backing_hd;
+    }
+
+    if (*pnum == 0) {
+        *pnum = sect_count;
+    }
+    return 0;
+}
+
+#define MAX_COMPARE_REQS 16
+
+typedef struct ImgCmpState ImgCmpState;
+
+/*
+ * A chunk being compared. If bs[1] is set, the chunk is read from both images
+ * and the buffers are compared; otherwise it is only read from bs[0] and must
+ * contain zeroes.
+ */
+typedef struct ImgCmpReq {
+    ImgCmpState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    BlockDriverState *bs[2];
+    const char *filename[2];
+    uint8_t *buf[2];
+    struct iovec iov[2];
+    QEMUIOVector qiov[2];
+    int pending;
+    bool failed;
+    bool busy;
+} ImgCmpReq;
+
+/*
+ * Up to nr_reqs chunks are read concurrently. Chunks are submitted in order,
+ * so once a difference or an error was found no further ones are started, and
+ * the lowest mismatching sector of those in flight is the first one overall.
  */
-static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
-                               int sect_count, const char *filename,
-                               uint8_t *buffer, bool quiet)
+struct ImgCmpState {
+    AioContext *ctx;
+    ImgCmpReq reqs[MAX_COMPARE_REQS];
+    int nr_reqs;
+    int in_flight;
+    int64_t mismatch;       /* first differing sector, -1 if none found */
+    int ret;                /* 4 after a read error */
+};
+
+static void compare_read_done(ImgCmpReq *req, int i, int ret)
 {
-    int pnum, ret = 0;
-    ret = bdrv_read(bs, sect_num, buffer, sect_count);
+    ImgCmpState *s = req->s;
+    int64_t sector_num;
+    int res, pnum;
+
     if (ret < 0) {
         error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     sectors_to_bytes(sect_num), filename, strerror(-ret));
-        return ret;
+                     sectors_to_bytes(req->sector_num), req->filename[i],
+                     strerror(-ret));
+        req->failed = true;
+        s->ret = 4;
     }
-    ret = is_allocated_sectors(buffer, sect_count, &pnum);
-    if (ret || pnum != sect_count) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                sectors_to_bytes(ret ? sect_num : sect_num + pnum));
-        return 1;
+    if (--req->pending > 0) {
+        return;
     }
 
-    return 0;
+    if (!req->failed) {
+        if (req->bs[1]) {
+            res = compare_sectors(req->buf[0], req->buf[1], req->nb_sectors,
+                                  &pnum);
+        } else {
+            res = is_allocated_sectors(req->buf[0], req->nb_sectors, &pnum);
+        }
+        if (res || pnum != req->nb_sectors) {
+            sector_num = res ? req->sector_num : req->sector_num + pnum;
+            if (s->mismatch < 0 || sector_num < s->mismatch) {
+                s->mismatch = sector_num;
+            }
+        }
+    }
+    req->busy = false;
+    s->in_flight--;
+}
+
+static void compare_read_cb1(void *opaque, int ret)
+{
+    compare_read_done(opaque, 0, ret);
+}
+
+static void compare_read_cb2(void *opaque, int ret)
+{
+    compare_read_done(opaque, 1, ret);
+}
+
+/*
+ * Starts reading nb_sectors at sector_num from bs1 and, if it is not NULL,
+ * bs2. Waits for a request to complete first if all of them are in flight.
+ */
+static void compare_submit(ImgCmpState *s, int64_t sector_num, int nb_sectors,
+                           BlockDriverState *bs1, const char *filename1,
+                           BlockDriverState *bs2, const char *filename2)
+{
+    ImgCmpReq *req = NULL;
+    int i;
+
+    while (s->in_flight == s->nr_reqs) {
+        aio_poll(s->ctx, true);
+    }
+    for (i = 0; i < s->nr_reqs; i++) {
+        if (!s->reqs[i].busy) {
+            req = &s->reqs[i];
+            break;
+        }
+    }
+    assert(req);
+
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+    req->bs[0] = bs1;
+    req->bs[1] = bs2;
+    req->filename[0] = filename1;
+    req->filename[1] = filename2;
+    req->pending = bs2 ? 2 : 1;
+    req->failed = false;
+    req->busy = true;
+    s->in_flight++;
+
+    for (i = 0; i < req->pending; i++) {
+        req->iov[i].iov_base = req->buf[i];
+        req->iov[i].iov_len = sectors_to_bytes(nb_sectors);
+        qemu_iovec_init_external(&req->qiov[i], &req->iov[i], 1);
+    }
+    bdrv_aio_readv(bs1, sector_num, &req->qiov[0], nb_sectors,
+                   compare_read_cb1, req);
+    if (bs2) {
+        bdrv_aio_readv(bs2, sector_num, &req->qiov[1], nb_sectors,
+                       compare_read_cb2, req);
+    }
+}
+
+static void compare_drain(ImgCmpState *s)
+{
+    while (s->in_flight > 0) {
+        aio_poll(s->ctx, true);
+    }
+}
+
+static bool compare_stopped(ImgCmpState *s)
+{
+    return s->ret || s->mismatch >= 0;
 }
 
 /*
@@ -1057,21 +1229,25 @@ static int img_compare(int argc, char **argv)
     BlockBackend *blk1, *blk2;
     BlockDriverState *bs1, *bs2;
     int64_t total_sectors1, total_sectors2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
     int pnum1, pnum2;
     int allocated1, allocated2;
+    int zero1, zero2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     int64_t total_sectors;
     int64_t sector_num = 0;
     int64_t nb_sectors;
-    int c, pnum;
+    int c, i, pnum;
     uint64_t progress_base;
+    int num_reqs = 8;
+    ImgCmpState s = {
+        .mismatch = -1,
+    };
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
-        c = getopt(argc, argv, "hf:F:T:pqs");
+        c = getopt(argc, argv, "hf:F:m:T:pqs");
         if (c == -1) {
             break;
         }
@@ -1086,6 +1262,17 @@ static int img_compare(int argc, char **argv)
         case 'F':
             fmt2 = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_reqs = strtol(optarg, &end, 10);
+            if (*end || num_reqs < 1 || num_reqs > MAX_COMPARE_REQS) {
+                error_report("Invalid number of parallel requests. Allowed "
+                             "number is between 1 and %d", MAX_COMPARE_REQS);
+                return 2;
+            }
+            break;
+        }
         case 'T':
             cache = optarg;
             break;
@@ -1138,8 +1325,13 @@ static int img_compare(int argc, char **argv)
     }
     bs2 = blk_bs(blk2);
 
-    buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
-    buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
+    s.ctx = bdrv_get_aio_context(bs1);
+    s.nr_reqs = num_reqs;
+    for (i = 0; i < s.nr_reqs; i++) {
+        s.reqs[i].s = &s;
+        s.reqs[i].buf[0] = qemu_blockalign(bs1, IO_BUF_SIZE);
+        s.reqs[i].buf[1] = qemu_blockalign(bs2, IO_BUF_SIZE);
+    }
     total_sectors1 = bdrv_nb_sectors(bs1);
     if (total_sectors1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1166,6 +1358,9 @@ static int img_compare(int argc, char **argv)
     }
 
     for (;;) {
+        if (compare_stopped(&s)) {
+            break;
+        }
         nb_sectors = sectors_to_process(total_sectors, sector_num);
         if (nb_sectors <= 0) {
             break;
@@ -1187,62 +1382,70 @@ static int img_compare(int argc, char **argv)
         }
         nb_sectors = MIN(pnum1, pnum2);
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            if (strict) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
-                goto out;
+        if (allocated1 != allocated2 && strict) {
+            /* A difference before this offset must be reported first */
+            compare_drain(&s);
+            if (compare_stopped(&s)) {
+                break;
             }
+            ret = 1;
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n",
+                    sectors_to_bytes(sector_num));
+            goto out;
+        }
 
-            if (allocated1) {
-                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(bs2, sector_num, nb_sectors,
-                                          filename2, buf1, quiet);
+        /*
+         * Sectors unallocated in the whole backing chain read as zeroes; for
+         * allocated ones, the block status may tell the same without reading
+         * them. Only what is left has to be read and compared.
+         */
+        zero1 = zero2 = 1;
+        if (allocated1) {
+            zero1 = sectors_read_as_zero(bs1, sector_num, nb_sectors, &pnum1);
+            if (zero1 < 0) {
+                ret = 3;
+                error_report("Sector allocation test failed for %s", filename1);
+                goto out;
             }
-            if (ret) {
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 ": %s",
-                                 sectors_to_bytes(sector_num), strerror(-ret));
-                    ret = 4;
-                }
+            nb_sectors = MIN(nb_sectors, pnum1);
+        }
+        if (allocated2) {
+            zero2 = sectors_read_as_zero(bs2, sector_num, nb_sectors, &pnum2);
+            if (zero2 < 0) {
+                ret = 3;
+                error_report("Sector allocation test failed for %s", filename2);
                 goto out;
             }
+            nb_sectors = MIN(nb_sectors, pnum2);
+        }
+
+        if (!zero1 && !zero2) {
+            compare_submit(&s, sector_num, nb_sectors, bs1, filename1,
+                           bs2, filename2);
+        } else if (!zero1) {
+            compare_submit(&s, sector_num, nb_sectors, bs1, filename1,
+                           NULL, NULL);
+        } else if (!zero2) {
+            compare_submit(&s, sector_num, nb_sectors, bs2, filename2,
+                           NULL, NULL);
         }
         sector_num += nb_sectors;
         qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
     }
 
+    compare_drain(&s);
+    if (s.ret) {
+        ret = s.ret;
+        goto out;
+    }
+    if (s.mismatch >= 0) {
+        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                sectors_to_bytes(s.mismatch));
+        ret = 1;
+        goto out;
+    }
+
     if (total_sectors1 != total_sectors2) {
         BlockDriverState *bs_over;
         int64_t total_sectors_over;
@@ -1260,6 +1463,9 @@ static int img_compare(int argc, char **argv)
         }
 
         for (;;) {
+            if (compare_stopped(&s)) {
+                break;
+            }
             nb_sectors = sectors_to_process(total_sectors_over, sector_num);
             if (nb_sectors <= 0) {
                 break;
@@ -1275,29 +1481,46 @@ static int img_compare(int argc, char **argv)
             }
             nb_sectors = pnum;
             if (ret) {
-                ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    if (ret < 0) {
-                        error_report("Error while reading offset %" PRId64
-                                     " of %s: %s", sectors_to_bytes(sector_num),
-                                     filename_over, strerror(-ret));
-                        ret = 4;
-                    }
+                ret = sectors_read_as_zero(bs_over, sector_num, nb_sectors,
+                                           &pnum);
+                if (ret < 0) {
+                    ret = 3;
+                    error_report("Sector allocation test failed for %s",
+                                 filename_over);
                     goto out;
                 }
+                nb_sectors = pnum;
+                if (!ret) {
+                    compare_submit(&s, sector_num, nb_sectors,
+                                   bs_over, filename_over, NULL, NULL);
+                }
             }
             sector_num += nb_sectors;
             qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
         }
+
+        compare_drain(&s);
+        if (s.ret) {
+            ret = s.ret;
+            goto out;
+        }
+        if (s.mismatch >= 0) {
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    sectors_to_bytes(s.mismatch));
+            ret = 1;
+            goto out;
+        }
     }
 
     qprintf(quiet, "Images are identical.\n");
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
+    compare_drain(&s);
+    for (i = 0; i < s.nr_reqs; i++) {
+        qemu_vfree(s.reqs[i].buf[0]);
+        qemu_vfree(s.reqs[i].buf[1]);
+    }
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1306,6 +1529,330 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
+/*
+ * State of a convert with several worker coroutines (-m).  Each worker
+ * takes the next chunk of the input, reads it and writes it to the target,
+ * so up to num_coroutines chunks are in flight at any time.  Unless
+ * out-of-order writes were requested (-W), a worker waits until all chunks
+ * before its own have been written.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool compressed;
+    bool overlap_compressed;      /* target takes concurrent compressed writes */
+    bool has_zero_init;
+    bool has_backing;
+    int min_sparse;
+    int64_t buf_sectors;
+    int cluster_sectors;
+    int num_coroutines;
+    bool wr_in_order;
+
+    CoMutex lock;                 /* protects the chunk cursor below */
+    int src_cur;
+    int64_t src_cur_offset;
+    int64_t sector_num;           /* start of the next chunk */
+    int64_t sector_next_status;
+
+    int64_t wr_offs;              /* chunks before this one are written */
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    int running_coroutines;
+    int ret;
+} ImgConvertState;
+
+typedef struct ImgConvertWorker {
+    ImgConvertState *s;
+    int index;
+
+    /* Compressed write running in its own coroutine */
+    int64_t write_sector_num;
+    int write_n;
+    uint8_t *write_buf;
+    int write_ret;
+    bool write_done;
+    bool write_waiting;
+} ImgConvertWorker;
+
+/*
+ * Take the next chunk of the input.  Returns false at the end, otherwise
+ * the chunk [*sector_num, *sector_num + *n) starts at *src_sector of source
+ * *src and *copy is false if it needs not be written.  Uncompressed chunks
+ * lie within one source; compressed chunks are whole target clusters and
+ * may span several sources, as in the single-threaded loop.
+ */
+static bool coroutine_fn convert_co_next_chunk(ImgConvertState *s,
+                                               int64_t *sector_num, int *n,
+                                               int *src, int64_t *src_sector,
+                                               bool *copy)
+{
+    int64_t nb_sectors;
+    int n1;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->ret < 0 || s->sector_num >= s->total_sectors) {
+        qemu_co_mutex_unlock(&s->lock);
+        return false;
+    }
+    while (s->sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
+        s->src_cur_offset += s->src_sectors[s->src_cur];
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+    }
+
+    *sector_num = s->sector_num;
+    *src = s->src_cur;
+    *src_sector = s->sector_num - s->src_cur_offset;
+    *copy = true;
+    nb_sectors = MIN(s->total_sectors - s->sector_num,
+                     s->src_sectors[s->src_cur] - *src_sector);
+
+    if (!s->compressed && (s->has_backing || s->has_zero_init)) {
+        int64_t ret = bdrv_get_block_status(s->src[s->src_cur], *src_sector,
+                                            MIN(nb_sectors, INT_MAX), &n1);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", *src_sector, strerror(-ret));
+            s->ret = ret;
+            qemu_co_mutex_unlock(&s->lock);
+            return false;
+        }
+        /* Same rules as the single-threaded convert loop: zeroes need not
+         * be written to a zero-initialised target, and unallocated sectors
+         * come from the target's backing file. */
+        if ((s->has_zero_init && !s->has_backing && (ret & BDRV_BLOCK_ZERO)) ||
+            (s->has_backing && !(ret & BDRV_BLOCK_DATA))) {
+            *copy = false;
+        }
+        nb_sectors = MIN(nb_sectors, n1);
+    }
+
+    if (s->compressed) {
+        *n = MIN(s->total_sectors - s->sector_num, s->cluster_sectors);
+    } else {
+        *n = MIN(nb_sectors, s->buf_sectors);
+        /* round down to the target cluster, as the single-threaded loop */
+        if (*copy && s->cluster_sectors > 0 && *n >= s->cluster_sectors) {
+            int64_t next_aligned = *sector_num + *n;
+            next_aligned -= next_aligned % s->cluster_sectors;
+            if (*sector_num + *n > next_aligned) {
+                *n = next_aligned - *sector_num;
+            }
+        }
+    }
+    s->sector_num += *n;
+    qemu_co_mutex_unlock(&s->lock);
+    return true;
+}
+
+/* Read n sectors starting at src_sector of source src, and the following
+ * sources if the range extends past its end */
+static int coroutine_fn convert_co_read(ImgConvertState *s, int src,
+                                        int64_t src_sector, int n,
+                                        uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n1, ret;
+
+    while (n > 0) {
+        while (src_sector >= s->src_sectors[src]) {
+            src_sector -= s->src_sectors[src];
+            src++;
+            assert(src < s->src_num);
+        }
+        n1 = MIN(n, s->src_sectors[src] - src_sector);
+        iov.iov_base = buf;
+        iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_readv(s->src[src], src_sector, n1, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         src_sector, strerror(-ret));
+            return ret;
+        }
+        src_sector += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int n,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n1, ret;
+
+    if (s->compressed) {
+        if (buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        return bdrv_write_compressed(s->target, sector_num, buf, n);
+    }
+
+    n1 = n;
+    while (n > 0) {
+        if (!s->has_zero_init ||
+            is_allocated_sectors_min(buf, n, &n1, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->target, sector_num, n1, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_write_entry(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+
+    w->write_ret = convert_co_write(w->s, w->write_sector_num, w->write_n,
+                                    w->write_buf);
+    w->write_done = true;
+    if (w->write_waiting) {
+        qemu_coroutine_enter(w->s->co[w->index], NULL);
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+    ImgConvertState *s = w->s;
+    uint8_t *buf;
+    int64_t sector_num, src_sector;
+    int n, src, i, ret;
+    bool copy, write_pending;
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (convert_co_next_chunk(s, &sector_num, &n, &src, &src_sector,
+                                 &copy)) {
+        if (copy) {
+            ret = convert_co_read(s, src, src_sector, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep the target written front to back */
+            while (s->ret >= 0 && s->wr_offs != sector_num) {
+                s->wait_sector_num[w->index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[w->index] = -1;
+        }
+
+        write_pending = false;
+        if (s->ret >= 0 && copy && s->overlap_compressed) {
+            /*
+             * The target allocates compressed clusters in the order of the
+             * calls, but may compress them in the thread pool. Start the
+             * write in its own coroutine, so that the next chunk can be
+             * handed to the target while this one is being compressed.
+             */
+            w->write_sector_num = sector_num;
+            w->write_n = n;
+            w->write_buf = buf;
+            w->write_done = false;
+            w->write_waiting = false;
+            qemu_coroutine_enter(qemu_coroutine_create(convert_co_write_entry),
+                                 w);
+            write_pending = true;
+        } else if (s->ret >= 0 && copy) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* wake the worker holding the next chunk, or all on error */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] >= 0 &&
+                    (s->ret < 0 || s->wait_sector_num[i] == s->wr_offs)) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    if (s->ret >= 0) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (write_pending) {
+            /* buf is in use until the write is done */
+            while (!w->write_done) {
+                w->write_waiting = true;
+                qemu_coroutine_yield();
+            }
+            w->write_waiting = false;
+            if (w->write_ret < 0) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-w->write_ret));
+                s->ret = w->write_ret;
+            }
+        }
+        if (s->ret < 0) {
+            break;
+        }
+        qemu_progress_print(100.0 * n / s->total_sectors, 100);
+    }
+
+    qemu_vfree(buf);
+    s->co[w->index] = NULL;
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    ImgConvertWorker workers[MAX_COROUTINES];
+    AioContext *ctx = bdrv_get_aio_context(s->target);
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        workers[i].s = s;
+        workers[i].index = i;
+        s->wait_sector_num[i] = -1;
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], &workers[i]);
+        }
+    }
+
+    while (s->running_coroutines) {
+        aio_poll(ctx, true);
+    }
+
+    if (s->compressed && s->ret >= 0) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, n, n1, bs_n, bs_i, compress, cluster_sectors, skip_create;
@@ -1330,6 +1877,8 @@ static int img_convert(int argc, char **argv)
     bool quiet = false;
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
+    int num_coroutines = 1;
+    bool wr_in_order = true;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1339,7 +1888,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1429,6 +1978,21 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1647,12 +2211,55 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    /* after bdrv_get_info(): some formats can only be written compressed */
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     if (compress) {
         if (cluster_sectors <= 0 || cluster_sectors > bufsectors) {
             error_report("invalid cluster size");
             ret = -1;
             goto out;
         }
+    }
+
+    if (num_coroutines > 1 || !wr_in_order) {
+        ImgConvertState state = {
+            .src = bs,
+            .src_sectors = bs_sectors,
+            .src_num = bs_n,
+            .total_sectors = total_sectors,
+            .target = out_bs,
+            .compressed = compress,
+            .overlap_compressed = compress &&
+                out_bs->drv->supports_concurrent_compressed_writes,
+            .has_backing = out_baseimg != NULL,
+            .min_sparse = min_sparse,
+            .buf_sectors = bufsectors,
+            .cluster_sectors = cluster_sectors,
+            .num_coroutines = num_coroutines,
+            .wr_in_order = wr_in_order,
+        };
+
+        if (!compress) {
+            state.has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
+            if (!state.has_zero_init &&
+                bdrv_can_write_zeroes_with_unmap(out_bs)) {
+                ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
+                if (ret < 0) {
+                    goto out;
+                }
+                state.has_zero_init = true;
+            }
+        }
+        ret = convert_do_copy(&state);
+        goto out;
+    }
+
+    if (compress) {
         sector_num = 0;
 
         nb_sectors = total_sectors;
@@ -3003,6 +3610,350 @@ out:
     return 0;
 }
 
+#define BENCH_PATTERN_RANDOM (-1)
+
+typedef struct BenchData {
+    BlockBackend *blk;
+    int64_t image_size;
+    int bufsize;
+    int64_t step;
+    int64_t start;
+    int64_t offset;             /* next sequential or strided offset */
+    bool random;
+    int write_pct;              /* 0: reads only, 100: writes only */
+    int flush_interval;
+    int nrreq;                  /* requests left to submit */
+    int in_flight;
+    int writes_done;
+    int ret;
+    unsigned int seed;
+    int64_t *lat;               /* completion latency in ns, per request */
+    int nr_lat;
+} BenchData;
+
+typedef struct BenchReq {
+    BenchData *b;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start;
+    bool write;
+} BenchReq;
+
+static void bench_cb(void *opaque, int ret);
+
+static int64_t bench_next_offset(BenchData *b)
+{
+    int64_t offset;
+
+    if (b->random) {
+        int64_t nr = (b->image_size - b->start) / b->bufsize;
+        int64_t r = ((int64_t)rand_r(&b->seed) << 31) ^ rand_r(&b->seed);
+        return b->start + (r % nr) * b->bufsize;
+    }
+    offset = b->offset;
+    b->offset += b->step;
+    if (b->offset + b->bufsize > b->image_size) {
+        b->offset = b->start;
+    }
+    return offset;
+}
+
+static void bench_submit(BenchReq *req)
+{
+    BenchData *b = req->b;
+    int64_t offset = bench_next_offset(b);
+
+    req->write = (rand_r(&b->seed) % 100) < b->write_pct;
+    req->start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    b->nrreq--;
+    b->in_flight++;
+    if (req->write) {
+        blk_aio_writev(b->blk, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                       b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    } else {
+        blk_aio_readv(b->blk, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                      b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    }
+}
+
+static void bench_flush_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+
+    if (ret < 0) {
+        error_report("Failed flush request: %s", strerror(-ret));
+        b->ret = ret;
+    }
+    b->in_flight--;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchData *b = req->b;
+
+    b->in_flight--;
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        b->ret = ret;
+        return;
+    }
+    b->lat[b->nr_lat++] = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - req->start;
+
+    if (req->write && b->flush_interval &&
+        (++b->writes_done % b->flush_interval) == 0) {
+        b->in_flight++;
+        blk_aio_flush(b->blk, bench_flush_cb, b);
+    }
+    if (b->nrreq > 0 && b->ret == 0) {
+        bench_submit(req);
+    }
+}
+
+static int bench_cmp_lat(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double bench_lat_us(BenchData *b, double pct)
+{
+    int i = (int)((b->nr_lat - 1) * pct / 100.0 + 0.5);
+
+    return b->lat[i] / 1000.0;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    bool quiet = false;
+    int aio_flags = 0;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    int64_t bufsize = 4096;
+    int64_t step = 0;
+    int pattern = 0;
+    int flags = BDRV_O_FLAGS;
+    int i;
+    BlockBackend *blk = NULL;
+    uint8_t *buf = NULL;
+    BenchReq *reqs = NULL;
+    struct timeval t1, t2;
+    double secs;
+    char *end;
+    BenchData data = {
+        .write_pct = 0,
+        .seed = 1,
+    };
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {"mix", required_argument, 0, OPTION_MIX},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:i:o:qs:S:t:w", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+            count = strtol(optarg, &end, 0);
+            if (*end || count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 0);
+            if (*end || depth <= 0 || depth > 4096) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'i':
+            if (!strcmp(optarg, "native")) {
+                aio_flags = BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "io_uring")) {
+                aio_flags = BDRV_O_IO_URING;
+            } else if (strcmp(optarg, "threads")) {
+                error_report("Invalid AIO mode '%s'", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 's':
+            bufsize = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (bufsize <= 0 || bufsize > INT_MAX || *end) {
+                error_report("Invalid request size specified");
+                return 1;
+            }
+            break;
+        case 'S':
+            step = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (step < 0 || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            data.write_pct = 100;
+            break;
+        case OPTION_MIX:
+            data.write_pct = strtol(optarg, &end, 0);
+            if (*end || data.write_pct < 0 || data.write_pct > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            break;
+        case OPTION_RANDOM:
+            data.random = true;
+            break;
+        case OPTION_FLUSH_INTERVAL:
+            data.flush_interval = strtol(optarg, &end, 0);
+            if (*end || data.flush_interval < 0) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            break;
+        case OPTION_PATTERN:
+            if (!strcmp(optarg, "random")) {
+                pattern = BENCH_PATTERN_RANDOM;
+            } else {
+                pattern = strtol(optarg, &end, 0);
+                if (*end || pattern < 0 || pattern > 0xff) {
+                    error_report("Invalid pattern byte specified");
+                    return 1;
+                }
+            }
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if ((offset | bufsize | step) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Offset, request size and step must be multiples of %d",
+                     BDRV_SECTOR_SIZE);
+        return 1;
+    }
+    if (data.write_pct) {
+        flags |= BDRV_O_RDWR;
+    }
+    flags |= aio_flags;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        return 1;
+    }
+
+    data.blk = blk;
+    data.image_size = blk_getlength(blk);
+    data.bufsize = bufsize;
+    data.step = step ? step : bufsize;
+    data.start = offset;
+    data.offset = offset;
+    data.nrreq = count;
+    data.lat = g_new(int64_t, count);
+    if (data.image_size < 0 || offset + bufsize > data.image_size) {
+        error_report("Image is too small for offset and request size");
+        ret = -1;
+        goto out;
+    }
+
+    depth = MIN(depth, count);
+    buf = blk_blockalign(blk, depth * bufsize);
+    if (pattern == BENCH_PATTERN_RANDOM) {
+        for (i = 0; i < depth * bufsize; i++) {
+            buf[i] = rand_r(&data.seed) >> 7;
+        }
+    } else {
+        memset(buf, pattern, depth * bufsize);
+    }
+    reqs = g_new0(BenchReq, depth);
+
+    qprintf(quiet, "Sending %d requests (%d%% writes), %d bytes each, "
+            "%d in parallel (starting at offset %" PRId64 ", %s %" PRId64
+            ")\n", count, data.write_pct, data.bufsize, depth, offset,
+            data.random ? "random, aligned to" : "step size", data.random ?
+            (int64_t)data.bufsize : data.step);
+
+    gettimeofday(&t1, NULL);
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = &data;
+        reqs[i].iov.iov_base = buf + i * bufsize;
+        reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+        bench_submit(&reqs[i]);
+    }
+    while (data.in_flight > 0) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+    gettimeofday(&t2, NULL);
+
+    if (data.ret < 0) {
+        ret = data.ret;
+        goto out;
+    }
+
+    secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+    qsort(data.lat, data.nr_lat, sizeof(data.lat[0]), bench_cmp_lat);
+    qprintf(quiet, "Run completed in %3.3f seconds.\n", secs);
+    qprintf(quiet, "%.0f IOPS, %.2f MB/s\n", count / secs,
+            (double)count * bufsize / secs / (1024 * 1024));
+    qprintf(quiet, "Latency (us): min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+            "p99.9 %.1f, max %.1f\n",
+            bench_lat_us(&data, 0), bench_lat_us(&data, 50),
+            bench_lat_us(&data, 90), bench_lat_us(&data, 99),
+            bench_lat_us(&data, 99.9), bench_lat_us(&data, 100));
+
+out:
+    qemu_vfree(buf);
+    g_free(reqs);
+    g_free(data.lat);
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
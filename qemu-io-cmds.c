@@ -282,6 +282,19 @@ static void *qemu_io_alloc(BlockDriverState *bs, size_t len, int pattern)
     return buf;
 }
 
+/*
+ * Fill a buffer with pseudo-random, incompressible data.
+ */
+static void qemu_io_fill_random(void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        p[i] = rand() >> 7;
+    }
+}
+
 static void qemu_io_free(void *p)
 {
     if (qemuio_misalign) {
@@ -926,6 +939,7 @@ static void write_help(void)
 " -c, -- write compressed data with bdrv_write_compressed\n"
 " -p, -- use bdrv_pwrite to write the file\n"
 " -P, -- use different pattern to fill file\n"
+" -r, -- fill the buffer with random (incompressible) data\n"
 " -C, -- report statistics in a machine parsable format\n"
 " -q, -- quiet mode, do not show I/O statistics\n"
 " -z, -- write zeroes using bdrv_co_write_zeroes\n"
@@ -940,7 +954,7 @@ static const cmdinfo_t write_cmd = {
     .cfunc      = write_f,
     .argmin     = 2,
     .argmax     = -1,
-    .args       = "[-bcCpqz] [-P pattern ] off len",
+    .args       = "[-bcCpqrz] [-P pattern ] off len",
     .oneline    = "writes a number of bytes at a specified offset",
     .help       = write_help,
 };
@@ -949,7 +963,7 @@ static int write_f(BlockDriverState *bs, int argc, char **argv)
 {
     struct timeval t1, t2;
     int Cflag = 0, pflag = 0, qflag = 0, bflag = 0, Pflag = 0, zflag = 0;
-    int cflag = 0;
+    int cflag = 0, rflag = 0;
     int c, cnt;
     char *buf = NULL;
     int64_t offset;
@@ -958,7 +972,7 @@ static int write_f(BlockDriverState *bs, int argc, char **argv)
     int total = 0;
     int pattern = 0xcd;
 
-    while ((c = getopt(argc, argv, "bcCpP:qz")) != EOF) {
+    while ((c = getopt(argc, argv, "bcCpP:qrz")) != EOF) {
         switch (c) {
         case 'b':
             bflag = 1;
@@ -982,6 +996,9 @@ static int write_f(BlockDriverState *bs, int argc, char **argv)
         case 'q':
             qflag = 1;
             break;
+        case 'r':
+            rflag = 1;
+            break;
         case 'z':
             zflag = 1;
             break;
@@ -999,8 +1016,8 @@ static int write_f(BlockDriverState *bs, int argc, char **argv)
         return 0;
     }
 
-    if (zflag && Pflag) {
-        printf("-z and -P cannot be specified at the same time\n");
+    if (zflag + Pflag + rflag > 1) {
+        printf("-z, -P, or -r cannot be specified at the same time\n");
         return 0;
     }
 
@@ -1033,6 +1050,9 @@ static int write_f(BlockDriverState *bs, int argc, char **argv)
 
     if (!zflag) {
         buf = qemu_io_alloc(bs, count, pattern);
+        if (rflag) {
+            qemu_io_fill_random(buf, count);
+        }
     }
 
     gettimeofday(&t1, NULL);
@@ -1526,6 +1546,7 @@ static void aio_write_help(void)
 " The write is performed asynchronously and the aio_flush command must be\n"
 " used to ensure all outstanding aio requests have been completed.\n"
 " -P, -- use different pattern to fill file\n"
+" -r, -- fill the buffer with random (incompressible) data\n"
 " -C, -- report statistics in a machine parsable format\n"
 " -q, -- quiet mode, do not show I/O statistics\n"
 "\n");
@@ -1538,7 +1559,7 @@ static const cmdinfo_t aio_write_cmd = {
     .cfunc      = aio_write_f,
     .argmin     = 2,
     .argmax     = -1,
-    .args       = "[-Cq] [-P pattern ] off len [len..]",
+    .args       = "[-Cqr] [-P pattern ] off len [len..]",
     .oneline    = "asynchronously writes a number of bytes",
     .help       = aio_write_help,
 };
@@ -1547,9 +1568,10 @@ static int aio_write_f(BlockDriverState *bs, int argc, char **argv)
 {
     int nr_iov, c;
     int pattern = 0xcd;
+    int rflag = 0;
     struct aio_ctx *ctx = g_new0(struct aio_ctx, 1);
 
-    while ((c = getopt(argc, argv, "CqP:")) != EOF) {
+    while ((c = getopt(argc, argv, "CqrP:")) != EOF) {
         switch (c) {
         case 'C':
             ctx->Cflag = 1;
@@ -1557,6 +1579,9 @@ static int aio_write_f(BlockDriverState *bs, int argc, char **argv)
         case 'q':
             ctx->qflag = 1;
             break;
+        case 'r':
+            rflag = 1;
+            break;
         case 'P':
             pattern = parse_pattern(optarg);
             if (pattern < 0) {
@@ -1596,6 +1621,9 @@ static int aio_write_f(BlockDriverState *bs, int argc, char **argv)
         g_free(ctx);
         return 0;
     }
+    if (rflag) {
+        qemu_io_fill_random(ctx->buf, ctx->qiov.size);
+    }
 
     gettimeofday(&ctx->t1, NULL);
     bdrv_aio_writev(bs, ctx->offset >> 9, &ctx->qiov,
@@ -96,8 +96,8 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-#ifdef CONFIG_LINUX_AIO
-"      --aio=MODE            set AIO mode (native or threads)\n"
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 #endif
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, discard)\n"
@@ -412,7 +412,7 @@ int main(int argc, char **argv)
         { "load-snapshot", 1, NULL, 'l' },
         { "nocache", 0, NULL, 'n' },
         { "cache", 1, NULL, QEMU_NBD_OPT_CACHE },
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
@@ -467,16 +467,22 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid cache mode `%s'", optarg);
             }
             break;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         case QEMU_NBD_OPT_AIO:
             if (seen_aio) {
                 errx(EXIT_FAILURE, "--aio can only be specified once");
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
+            if (!strcmp(optarg, "threads")) {
                 /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+            } else if (!strcmp(optarg, "native")) {
+                flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
+#endif
             } else {
                errx(EXIT_FAILURE, "invalid aio mode `%s'", optarg);
             }
@@ -988,6 +988,33 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_block_commit,
     },
 
+    {
+        .name       = "selfie-defrag",
+        .args_type  = "device:B,threshold:i?,speed:o?",
+        .mhandler.cmd_new = qmp_marshal_input_selfie_defrag,
+    },
+
+SQMP
+selfie-defrag
+-------------
+
+Rewrite fragmented ranges of a selfie image into physically contiguous zones.
+
+Arguments:
+
+- "device": The device's ID, must be unique (json-string)
+- "threshold": percentage of discontiguous clusters in a range of 512
+               clusters that makes it fragmented (json-int, optional)
+- "speed": the maximum speed, in bytes per second (json-int, optional)
+
+Example:
+
+-> { "execute": "selfie-defrag", "arguments": { "device": "virtio0",
+                                                "threshold": 10 } }
+<- { "return": {} }
+
+EQMP
+
 SQMP
 block-commit
 ------------
@@ -2261,6 +2288,10 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+- "driver-specific": A json-object with statistics specific to the image
+                     format, if the driver provides any. It contains a
+                     "type" (json-string, e.g. "selfie") and a "data"
+                     json-object (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
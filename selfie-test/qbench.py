@@ -0,0 +1,322 @@
+#!/usr/bin/env python
+# Self-contained block format benchmark
+#
+# Runs the same access patterns against selfie, raw and qcow2 images on a
+# tmpfs directory through qemu-io, and reports throughput, latency
+# percentiles and host write amplification side by side.
+#
+# Needs only qemu-img and qemu-io from a build tree: no root, nbd or guest.
+#
+# Usage:
+#   qbench.py [--qemu-dir DIR] [--dir TMPFS] [--quick]
+#             [--save BASELINE.json] [--baseline BASELINE.json]
+#
+# With --baseline, exits with status 1 if any case lost more throughput, or
+# gained more write amplification, than --tolerance allows.
+#
+# Host write amplification is the number of bytes qemu-io passed to write
+# system calls (wchar in /proc/PID/io) divided by the bytes the workload
+# wrote: 1.0 means no metadata overhead. wchar also counts qemu-io's own
+# output and eventfd writes, so the wchar of the same commands run against
+# a null-co:// device is subtracted first. (write_bytes would not need this,
+# but it stays 0 on tmpfs.)
+
+import json
+import optparse
+import os
+import random
+import subprocess
+import sys
+import time
+
+PROMPT = 'qemu-io> '
+
+FORMATS = ['selfie', 'raw', 'qcow2']
+
+# name: (write?, sequential?, request size is a part of a cluster?, prefill?)
+WORKLOADS = {
+    'seqwrite':  (True,  True,  False, False),
+    'randwrite': (True,  False, False, False),
+    'partial':   (True,  False, True,  True),
+    'overwrite': (True,  False, False, True),
+    'seqread':   (False, True,  False, True),
+    'randread':  (False, False, False, True),
+}
+
+# share of requests written with incompressible data
+DATA_MIX = {
+    'zero': 0.0,    # constant pattern, always compresses
+    'mix': 0.5,
+    'random': 1.0,
+}
+
+
+def parse_size(s):
+    units = {'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30}
+    s = s.strip().lower()
+    if s[-1] in units:
+        return int(s[:-1]) * units[s[-1]]
+    return int(s)
+
+
+def fmt_size(n):
+    for unit, shift in (('M', 20), ('K', 10)):
+        if n >= (1 << shift) and n % (1 << shift) == 0:
+            return '%d%s' % (n >> shift, unit)
+    return str(n)
+
+
+# seconds from a qemu-io timing report
+def parse_time(ts):
+    ts = ts.strip()
+    if ts.endswith(' sec'):
+        return float(ts[:-4])
+    secs = 0.0
+    for part in ts.split(':'):
+        secs = secs * 60 + float(part)
+    return secs
+
+
+class QemuIO(object):
+    """qemu-io driven one command at a time through its prompt"""
+
+    def __init__(self, qemu_io, args):
+        self.proc = subprocess.Popen([qemu_io] + args,
+                                     stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT)
+        self.read_prompt()
+
+    def read_prompt(self):
+        out = b''
+        prompt = PROMPT.encode()
+        while not out.endswith(prompt):
+            c = os.read(self.proc.stdout.fileno(), 4096)
+            if not c:
+                raise Exception('qemu-io exited: %s' % out.decode())
+            out += c
+        return out[:-len(prompt)].decode()
+
+    # qemu-io reads stdin with fgets() once it is readable: only send the
+    # next command when the previous one is done
+    def cmd(self, line):
+        self.proc.stdin.write((line + '\n').encode())
+        self.proc.stdin.flush()
+        return self.read_prompt()
+
+    def wchar(self):
+        with open('/proc/%d/io' % self.proc.pid) as f:
+            for line in f:
+                if line.startswith('wchar:'):
+                    return int(line.split()[1])
+        return 0
+
+    def close(self):
+        self.proc.stdin.write(b'quit\n')
+        self.proc.stdin.close()
+        self.proc.wait()
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    k = int(round((len(sorted_values) - 1) * p / 100.0))
+    return sorted_values[k]
+
+
+# latencies (seconds) of all requests reported in qemu-io output
+def parse_latencies(out):
+    lat = []
+    for line in out.splitlines():
+        # "4 KiB, 1 ops; 0.0001 sec (39.062 MiB/sec and 10000.0000 ops/sec)"
+        if ' ops; ' in line and '/sec' in line:
+            ts = line.split(' ops; ')[1].split(' (')[0]
+            lat.append(parse_time(ts))
+    return lat
+
+
+def make_offsets(nr, region, size, seq, rng):
+    if seq:
+        return [(i * size) % region for i in range(nr)]
+    return [rng.randrange(region // size) * size for i in range(nr)]
+
+
+# issue the workload's requests, returns (output, seconds, wchar delta)
+def run_ops(q, offsets, write, data, size, qd, rng):
+    wchar0 = q.wchar()
+    out = ''
+    t0 = time.time()
+    for i, off in enumerate(offsets):
+        if write:
+            fill = '-r' if rng.random() < DATA_MIX[data] else '-P 0x5a'
+            op = 'aio_write' if qd > 1 else 'write'
+            out += q.cmd('%s %s %d %d' % (op, fill, off, size))
+        else:
+            op = 'aio_read' if qd > 1 else 'read'
+            out += q.cmd('%s %d %d' % (op, off, size))
+        if qd > 1 and ((i + 1) % qd) == 0:
+            out += q.cmd('aio_flush')
+    if qd > 1:
+        out += q.cmd('aio_flush')
+    if write:
+        out += q.cmd('flush')
+    elapsed = time.time() - t0
+    return out, elapsed, q.wchar() - wchar0
+
+
+# wchar of the same requests on a device that does no I/O: qemu-io's own
+# output and event notifications
+def baseline_wchar(opts, offsets, write, data, size, qd, rng):
+    q = QemuIO(opts.qemu_io, [])
+    try:
+        q.cmd('open -o driver=null-co,size=%d' % opts.region)
+        return run_ops(q, offsets, write, data, size, qd, rng)[2]
+    finally:
+        q.close()
+
+
+def run_case(opts, fmt, cluster, workload, data, qd):
+    write, seq, partial, prefill = WORKLOADS[workload]
+    image = os.path.join(opts.dir, 'qbench.%s' % fmt)
+    region = opts.region
+    size = cluster // 2 if partial else max(cluster, opts.request)
+    rng = random.Random(cluster * 131 + qd)
+
+    create = [opts.qemu_img, 'create', '-q', '-f', fmt]
+    if fmt != 'raw':
+        create += ['-o', 'cluster_size=%d' % cluster]
+    subprocess.check_call(create + [image, str(region)])
+    q = QemuIO(opts.qemu_io, ['-f', fmt, image])
+    try:
+        if prefill:
+            for off in range(0, region, opts.prefill_chunk):
+                q.cmd('write -q -r %d %d' % (off, opts.prefill_chunk))
+            q.cmd('flush')
+
+        nr = max(opts.ops // max(1, size // opts.request), 16)
+        offsets = make_offsets(nr, region, size, seq, rng)
+        if partial:
+            # the second half of a cluster: exercises read-modify-write
+            offsets = [o - (o % cluster) + size for o in offsets]
+        state = rng.getstate()
+        out, elapsed, wchar = run_ops(q, offsets, write, data, size, qd, rng)
+    finally:
+        q.close()
+        os.unlink(image)
+    if write:
+        rng.setstate(state)
+        wchar -= baseline_wchar(opts, offsets, write, data, size, qd, rng)
+
+    lat = sorted(parse_latencies(out))
+    total = nr * size
+    return {
+        'mbps': total / elapsed / (1 << 20),
+        'iops': nr / elapsed,
+        'p50_us': percentile(lat, 50) * 1e6,
+        'p99_us': percentile(lat, 99) * 1e6,
+        'p999_us': percentile(lat, 99.9) * 1e6,
+        'amp': (float(wchar) / total) if write else None,
+    }
+
+
+def cases(opts):
+    for cluster in opts.clusters:
+        for workload in opts.workloads:
+            write = WORKLOADS[workload][0]
+            for data in (opts.data if write else ['zero']):
+                for qd in opts.qd:
+                    yield cluster, workload, data, qd
+
+
+def compare(results, baseline, tolerance):
+    failed = []
+    for key, r in sorted(results.items()):
+        b = baseline.get(key)
+        if b is None:
+            continue
+        if r['mbps'] < b['mbps'] * (1.0 - tolerance):
+            failed.append('%s: throughput %.1f MB/s, baseline %.1f MB/s'
+                          % (key, r['mbps'], b['mbps']))
+        if r['amp'] is not None and b['amp'] is not None and \
+           r['amp'] > b['amp'] * (1.0 + tolerance):
+            failed.append('%s: write amplification %.2f, baseline %.2f'
+                          % (key, r['amp'], b['amp']))
+    return failed
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = optparse.OptionParser()
+    parser.add_option('--qemu-dir', default=os.path.dirname(here),
+                      help='build directory with qemu-img and qemu-io')
+    parser.add_option('--dir', default='/dev/shm',
+                      help='directory for the images (use tmpfs)')
+    parser.add_option('--formats', default=','.join(FORMATS))
+    parser.add_option('--clusters', default='4k,64k,1m')
+    parser.add_option('--workloads', default=','.join(sorted(WORKLOADS)))
+    parser.add_option('--data', default='zero,mix,random')
+    parser.add_option('--qd', default='1,16', help='queue depths')
+    parser.add_option('--region', default='256m', help='image size')
+    parser.add_option('--request', default='4k',
+                      help='smallest request size (large clusters use theirs)')
+    parser.add_option('--ops', type='int', default=4096,
+                      help='requests per case at the smallest request size')
+    parser.add_option('--quick', action='store_true',
+                      help='one cluster size, queue depth and data mix')
+    parser.add_option('--save', help='write results to this file')
+    parser.add_option('--baseline', help='compare with results of --save')
+    parser.add_option('--tolerance', type='float', default=0.15)
+    opts, args = parser.parse_args()
+
+    opts.qemu_img = os.path.join(opts.qemu_dir, 'qemu-img')
+    opts.qemu_io = os.path.join(opts.qemu_dir, 'qemu-io')
+    for exe in (opts.qemu_img, opts.qemu_io):
+        if not os.access(exe, os.X_OK):
+            sys.stderr.write('need %s (use --qemu-dir)\n' % exe)
+            return 2
+    opts.formats = opts.formats.split(',')
+    opts.clusters = [parse_size(c) for c in opts.clusters.split(',')]
+    opts.workloads = opts.workloads.split(',')
+    opts.data = opts.data.split(',')
+    opts.qd = [int(q) for q in opts.qd.split(',')]
+    opts.region = parse_size(opts.region)
+    opts.request = parse_size(opts.request)
+    opts.prefill_chunk = 1 << 20
+    if opts.quick:
+        opts.clusters = opts.clusters[:1]
+        opts.data = ['mix']
+        opts.qd = opts.qd[:1]
+        opts.ops = min(opts.ops, 1024)
+        opts.region = min(opts.region, 64 << 20)
+
+    results = {}
+    print('amp: host bytes written (wchar) per byte written by the workload,')
+    print('     after subtracting the wchar of a null-co:// run of the same')
+    print('     commands (qemu-io output and eventfd writes)')
+    print('%-40s %8s %10s %10s %10s %10s %6s' % ('case', 'format', 'MB/s',
+          'IOPS', 'p50 us', 'p99 us', 'amp'))
+    for cluster, workload, data, qd in cases(opts):
+        for fmt in opts.formats:
+            name = '%s-%s-%s-qd%d' % (workload, fmt_size(cluster), data, qd)
+            r = run_case(opts, fmt, cluster, workload, data, qd)
+            results['%s/%s' % (fmt, name)] = r
+            amp = '-' if r['amp'] is None else '%.2f' % r['amp']
+            print('%-40s %8s %10.1f %10.0f %10.0f %10.0f %6s' % (name, fmt,
+                  r['mbps'], r['iops'], r['p50_us'], r['p99_us'], amp))
+            sys.stdout.flush()
+
+    if opts.save:
+        with open(opts.save, 'w') as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+    if opts.baseline:
+        with open(opts.baseline) as f:
+            failed = compare(results, json.load(f), opts.tolerance)
+        for line in failed:
+            print('REGRESSION ' + line)
+        if failed:
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
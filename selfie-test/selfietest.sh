@@ -1,11 +1,9 @@
 #!/bin/bash
 # clean
-rm -f /tmp/selfie-debug.log
 umount /dev/nbd0
 ./qemu-nbd -d /dev/nbd0
 ./qemu-nbd -d /dev/nbd0
 
-rm /tmp/selfie-debug.log
 # do it
 ./qemu-img create -f selfie selfie 8G
 ./qemu-nbd -d /dev/nbd0
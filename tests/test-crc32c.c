@@ -0,0 +1,93 @@
+/*
+ * Test crc32c routines
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+
+typedef struct {
+    const char *data;
+    uint32_t result;
+} Crc32cTest;
+
+static const Crc32cTest test_crc32c_data[] = {
+    { "", 0x00000000 },
+    { "a", 0xc1d04330 },
+    { "123456789", 0xe3069283 },
+    { "The quick brown fox jumps over the lazy dog", 0x22620404 },
+};
+
+/* Bitwise reference implementation of the reflected CRC-32C */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    int k;
+
+    while (length--) {
+        crc ^= *data++;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void test_crc32c_vectors(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_crc32c_data); i++) {
+        const Crc32cTest *test = &test_crc32c_data[i];
+        uint32_t r = crc32c(0xffffffff, (const uint8_t *)test->data,
+                            strlen(test->data));
+
+        g_assert_cmphex(r, ==, test->result);
+    }
+}
+
+/* Unaligned heads and short tails take a different path than the body */
+static void test_crc32c_alignment(void)
+{
+    uint8_t buf[4096 + 16];
+    int i, off, len;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 31 + (i >> 8);
+    }
+    for (off = 0; off < 16; off++) {
+        for (len = 0; len <= 4096; len += (len < 64) ? 1 : 61) {
+            g_assert_cmphex(crc32c(0xffffffff, buf + off, len), ==,
+                            crc32c_ref(0xffffffff, buf + off, len));
+        }
+    }
+}
+
+/* crc32c(crc32c(~0, a) ^ ~0, b) == crc32c(~0, a + b) */
+static void test_crc32c_chain(void)
+{
+    const uint8_t *data = (const uint8_t *)"The quick brown fox jumps over the lazy dog";
+    unsigned int len = strlen((const char *)data);
+    unsigned int split;
+
+    for (split = 0; split <= len; split++) {
+        uint32_t r = crc32c(0xffffffff, data, split) ^ 0xffffffff;
+
+        g_assert_cmphex(crc32c(r, data + split, len - split), ==,
+                        crc32c(0xffffffff, data, len));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/vectors", test_crc32c_vectors);
+    g_test_add_func("/crc32c/alignment", test_crc32c_alignment);
+    g_test_add_func("/crc32c/chain", test_crc32c_chain);
+    return g_test_run();
+}
@@ -105,11 +105,61 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_update_table(uint32_t crc, const uint8_t *data,
+                                    unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#ifdef CONFIG_CRC32C_SSE42
+#include <cpuid.h>
+#include <nmmintrin.h>
+
+/* The SSE4.2 crc32 instruction implements the same reflected CRC-32C
+ * update as the table above, eight bytes at a time.  */
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_update_sse42(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    uint64_t crc64 = crc;
+
+    while (length && ((uintptr_t)data & 7)) {
+        crc64 = _mm_crc32_u8(crc64, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)data);
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc64 = _mm_crc32_u8(crc64, *data++);
+    }
+    return crc64;
+}
+
+static uint32_t (*crc32c_update)(uint32_t, const uint8_t *, unsigned int) =
+    crc32c_update_table;
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, 0) >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_SSE4_2) {
+            crc32c_update = crc32c_update_sse42;
+        }
+    }
+}
+#else
+#define crc32c_update crc32c_update_table
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_update(crc, data, length) ^ 0xffffffff;
 }
 